@@ -0,0 +1,304 @@
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+
+#include "lispy.h"
+
+/* Benchmark kernels. Each one runs setup once in a fresh environment and
+   then times run, reporting the fastest of the runs along with what the
+   heap allocated per run and how many collections all runs took. Results
+   are written one JSON object per line:
+
+   {"kernel":"fib","runs":10,"seconds":0.1,"objects":10,"bytes":640,
+    "collections":0,"units":242785,"unit":"calls","throughput":2427850}
+
+   With a baseline of such lines, each result also carries the baseline
+   time and the ratio to it. The exit status is 1 if any kernel got slower
+   than the threshold allows */
+
+namespace {
+
+struct kernel {
+    std::string name;
+    std::string setup;
+    std::string run;
+    double units;       ///< work done by one run, in unit
+    std::string unit;
+};
+
+double fibCalls(int n) {
+    double a = 1, b = 1;        // calls of fib(0) and fib(1)
+    for (int i = 2; i <= n; ++i) {
+        double c = a + b + 1;
+        a = b;
+        b = c;
+    }
+    return n ? b : a;
+}
+
+double takCalls(int x, int y, int z, int &result) {
+    if (!(y < x)) {
+        result = z;
+        return 1;
+    }
+    int a, b, c;
+    double calls = 1 + takCalls(x - 1, y, z, a) + takCalls(y - 1, z, x, b)
+            + takCalls(z - 1, x, y, c);
+    return calls + takCalls(a, b, c, result);
+}
+
+/// quoted list of n pseudo random numbers, the same on every run
+std::string randomList(size_t n) {
+    std::string out = "(quote (";
+    uint32_t x = 12345;
+    for (size_t i = 0; i < n; ++i) {
+        x = x * 1103515245 + 12345;
+        out += std::to_string((x >> 8) % 100000);
+        out += ' ';
+    }
+    return out + "))";
+}
+
+/// a wide list of mixed atoms followed by a deeply nested one
+std::string bigInput(size_t width, size_t depth) {
+    std::string out = "(quote (";
+    for (size_t i = 0; i < width; ++i) {
+        switch (i % 4) {
+        case 0: out += std::to_string(i); break;
+        case 1: out += "sym" + std::to_string(i); break;
+        case 2: out += std::to_string(i) + ".5"; break;
+        case 3: out += "\"str" + std::to_string(i) + "\""; break;
+        }
+        out += ' ';
+    }
+    for (size_t i = 0; i < depth; ++i)
+        out += "(x ";
+    out += std::string(depth, ')');
+    return out + "))";
+}
+
+/// many small top level forms, as in a generated script
+std::string bigScript(size_t functions) {
+    std::string out;
+    for (size_t i = 0; i < functions; ++i) {
+        std::string f = "f" + std::to_string(i);
+        out += "(define " + f + " (lambda (x) (+ x " + std::to_string(i)
+                + ")))\n";
+        out += "(" + f + " 1)\n";
+    }
+    return out;
+}
+
+std::vector<kernel> kernels() {
+    static const char *lists =
+        "(define build (lambda (n acc)"
+        "  (if (< n 1) acc (build (- n 1) (cons n acc)))))"
+        "(define rev (lambda (l acc)"
+        "  (if (= (length l) 0) acc (rev (cdr l) (cons (car l) acc)))))"
+        "(define odds (lambda (l)"
+        "  (if (= (length l) 0) l (cons (car l) (evens (cdr l))))))"
+        "(define evens (lambda (l)"
+        "  (if (= (length l) 0) l (odds (cdr l)))))"
+        "(define merge (lambda (a b)"
+        "  (if (= (length a) 0) b"
+        "    (if (= (length b) 0) a"
+        "      (if (< (car b) (car a))"
+        "        (cons (car b) (merge a (cdr b)))"
+        "        (cons (car a) (merge (cdr a) b)))))))"
+        "(define msort (lambda (l)"
+        "  (if (< (length l) 2) l"
+        "    (merge (msort (odds l)) (msort (evens l))))))";
+
+    int tak;
+    double tak_calls = takCalls(22, 16, 8, tak);
+
+    std::string parse = bigInput(400000, 2000);
+    std::string script = bigScript(10000);
+
+    return {
+        {"fib",
+         "(define fib (lambda (n)"
+         "  (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))",
+         "(fib 25)", fibCalls(25), "calls"},
+        {"tak",
+         "(define tak (lambda (x y z)"
+         "  (if (< y x)"
+         "    (tak (tak (- x 1) y z) (tak (- y 1) z x) (tak (- z 1) x y))"
+         "    z)))",
+         "(tak 22 16 8)", tak_calls, "calls"},
+        {"nqueens",
+         "(define safe (lambda (row dist placed)"
+         "  (if (= (length placed) 0) #t"
+         "    (if (= (car placed) row) #f"
+         "      (if (= (car placed) (+ row dist)) #f"
+         "        (if (= (car placed) (- row dist)) #f"
+         "          (safe row (+ dist 1) (cdr placed))))))))"
+         "(define queens (lambda (n k placed)"
+         "  (if (= k 0) 1 (place n k placed 1))))"
+         "(define place (lambda (n k placed row)"
+         "  (if (> row n) 0"
+         "    (+ (if (safe row 1 placed)"
+         "           (queens n (- k 1) (cons row placed)) 0)"
+         "       (place n k placed (+ row 1))))))",
+         "(queens 8 8 (quote ()))", 92, "solutions"},
+        {"list-build", lists, "(build 200000 (quote ()))", 200000,
+         "elements"},
+        {"list-reverse",
+         std::string(lists) + "(define data (build 200000 (quote ())))",
+         "(rev data (quote ()))", 200000, "elements"},
+        {"list-sort",
+         std::string(lists) + "(define data " + randomList(20000) + ")",
+         "(msort data)", 20000, "elements"},
+        {"parse", "", parse, double(parse.size()), "bytes"},
+        {"closures",
+         "(define compose (lambda (f g) (lambda (x) (f (g x)))))"
+         "(define adder (lambda (n) (lambda (x) (+ x n))))"
+         "(define closures (lambda (i acc)"
+         "  (if (= i 0) acc"
+         "    (closures (- i 1) ((compose (adder i) (adder 1)) acc)))))",
+         "(closures 100000 0)", 300000, "closures"},
+        {"exec-script", "", script, 20000, "forms"},
+    };
+}
+
+struct result {
+    double seconds;
+    lispy::heap::totals made;
+};
+
+result measure(const kernel &k, int runs) {
+    // what earlier kernels left behind must not be collected on our time
+    lispy::heap &h = lispy::heap::instance();
+    h.collect();
+
+    lispy::environment env(lispy::shared_std());
+    lispy::exec(env, k.setup);
+    h.collect();
+
+    lispy::heap::totals before = h.made();
+    double best = 0;
+    for (int i = 0; i < runs; ++i) {
+        std::chrono::steady_clock::time_point start
+                = std::chrono::steady_clock::now();
+        lispy::exec(env, k.run);
+        std::chrono::duration<double> took
+                = std::chrono::steady_clock::now() - start;
+        if (i == 0 || took.count() < best)
+            best = took.count();
+    }
+    lispy::heap::totals after = h.made();
+
+    return result{best, {(after.objects - before.objects) / runs,
+                         (after.bytes - before.bytes) / runs,
+                         after.collections - before.collections}};
+}
+
+/// value of "name": in a result line, empty if there is none
+std::string field(const std::string &line, const std::string &name) {
+    std::string key = "\"" + name + "\":";
+    size_t at = line.find(key);
+    if (at == std::string::npos)
+        return std::string();
+    at += key.size();
+    if (at < line.size() && line[at] == '"') {
+        size_t end = line.find('"', at + 1);
+        return line.substr(at + 1, end - at - 1);
+    }
+    return line.substr(at, line.find_first_of(",}", at) - at);
+}
+
+/// seconds of each kernel in a baseline file
+std::map<std::string, double> readBaseline(const std::string &path) {
+    std::ifstream in(path);
+    if (!in)
+        throw std::invalid_argument("Cannot open " + path);
+
+    std::map<std::string, double> times;
+    std::string line;
+    while (std::getline(in, line)) {
+        std::string name = field(line, "kernel");
+        std::string seconds = field(line, "seconds");
+        if (!name.empty() && !seconds.empty())
+            times[name] = std::strtod(seconds.c_str(), nullptr);
+    }
+    return times;
+}
+
+void usage(const char *self) {
+    std::cerr << "usage: " << self << " [--runs N] [--baseline FILE]"
+              << " [--threshold RATIO] [KERNEL...]" << std::endl;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    int runs = 10;
+    double threshold = 1.3;
+    std::string baseline_path;
+    std::vector<std::string> only;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (arg == "--runs" && i + 1 < argc) {
+            runs = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--baseline" && i + 1 < argc) {
+            baseline_path = argv[++i];
+        } else if (arg == "--threshold" && i + 1 < argc) {
+            threshold = std::strtod(argv[++i], nullptr);
+        } else if (arg.size() && arg[0] == '-') {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        } else {
+            only.push_back(arg);
+        }
+    }
+
+    try {
+        std::map<std::string, double> baseline;
+        if (!baseline_path.empty())
+            baseline = readBaseline(baseline_path);
+
+        bool regressed = false;
+        for (const kernel &k : kernels()) {
+            if (!only.empty()
+                && std::find(only.begin(), only.end(), k.name) == only.end())
+                continue;
+
+            result r = measure(k, runs);
+
+            std::ostringstream line;
+            line << "{\"kernel\":\"" << k.name << "\""
+                 << ",\"runs\":" << runs
+                 << ",\"seconds\":" << r.seconds
+                 << ",\"objects\":" << r.made.objects
+                 << ",\"bytes\":" << r.made.bytes
+                 << ",\"collections\":" << r.made.collections
+                 << ",\"units\":" << k.units
+                 << ",\"unit\":\"" << k.unit << "\""
+                 << ",\"throughput\":" << k.units / r.seconds;
+
+            std::map<std::string, double>::const_iterator b
+                    = baseline.find(k.name);
+            if (b != baseline.end() && b->second > 0) {
+                double ratio = r.seconds / b->second;
+                line << ",\"baseline\":" << b->second
+                     << ",\"ratio\":" << ratio;
+                if (ratio > threshold) {
+                    line << ",\"regressed\":true";
+                    regressed = true;
+                }
+            }
+            line << "}";
+            std::cout << line.str() << std::endl;
+        }
+
+        return regressed ? EXIT_FAILURE : EXIT_SUCCESS;
+    } catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+}
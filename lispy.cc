@@ -6,10 +6,58 @@
 
 #include "lispy.h"
 
+// with --profile, prints the profile and writes its collapsed stacks
+static int finish(const std::string &profile, int status) {
+    if (profile.empty())
+        return status;
+
+    lispy::profiler &p = lispy::profiler::instance();
+    p.stop();
+    p.report(std::cerr);
+    try {
+        p.collapsed(profile);
+    } catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return status;
+}
+
 int main(int argc, char *argv[]) {
     const std::string prompt(">> ");
-    lispy::environment env;
-    lispy::bind_std(env);
+    lispy::environment env(lispy::shared_std());
+
+    // --profile path records the whole session, see lispy::profiler
+    std::string profile;
+    int first = 1;
+    if (argc > 2 && std::string(argv[1]) == "--profile") {
+        profile = argv[2];
+        first = 3;
+        lispy::profiler::instance().start();
+    }
+
+    // evaluate the files given, - stands for standard input. Images made
+    // by save-image are loaded as they are
+    if (argc > first) {
+        for (int i = first; i < argc; ++i) {
+            try {
+                std::string path(argv[i]);
+                if (path == "-") {
+                    lispy::reader in(STDIN_FILENO);
+                    lispy::exec(env, in);
+                } else if (lispy::image::probe(path)) {
+                    lispy::image::load(env, path);
+                } else {
+                    lispy::load(env, path);
+                }
+            } catch (const std::exception &e) {
+                std::cerr << argv[i] << ": Error: " << e.what() << std::endl;
+                return finish(profile, EXIT_FAILURE);
+            }
+        }
+
+        return finish(profile, EXIT_SUCCESS);
+    }
 
     while (true) {
         char *cmd = readline(prompt.c_str());
@@ -33,5 +81,5 @@ int main(int argc, char *argv[]) {
 
     std::cout << std::endl;
 
-    return EXIT_SUCCESS;
+    return finish(profile, EXIT_SUCCESS);
 }
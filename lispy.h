@@ -2,25 +2,50 @@
     Simple, incomplete LISP implementation.
  */
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
-#include <functional>
-#include <map>
+#include <chrono>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <memory>
 #include <string>
 #include <stdexcept>
+#include <type_traits>
+#include <condition_variable>
 #include <deque>
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace lispy {
 
-// holds an iterator range to string. Used to avoid string copying when parsing
-// and interpretting the input
+// holds a range of characters. Used to avoid string copying when parsing
+// and interpretting the input, which may be a string, a read buffer or a
+// memory mapped file
 class str_view {
 public:
-    typedef std::string::const_iterator const_iterator;
+    typedef const char *const_iterator;
 
     str_view() : from(), to() {}
-    str_view(const std::string &s) : from(s.begin()), to(s.end()) {}
+    str_view(const std::string &s)
+        : from(s.data()), to(s.data() + s.size()) {}
     str_view(const_iterator from, const_iterator to) : from(from), to(to) {}
 
     const_iterator begin() const { return from; }
@@ -34,6 +59,14 @@ public:
         return std::string(from, to);
     }
 
+    size_t size() const {
+        return to - from;
+    }
+
+    bool operator==(const str_view &other) const {
+        return size() == other.size() && std::equal(from, to, other.from);
+    }
+
     bool operator==(const char *dta) {
         const_iterator i = from;
         for (; *dta && i != to; ++dta, ++i)
@@ -51,91 +84,364 @@ public:
         return true;
     }
 
+    /// FNV-1a over the characters in the range
+    struct hash {
+        size_t operator()(const str_view &s) const {
+            uint64_t h = 14695981039346656037ULL;
+            for (const_iterator i = s.from; i != s.to; ++i) {
+                h ^= static_cast<unsigned char>(*i);
+                h *= 1099511628211ULL;
+            }
+            return static_cast<size_t>(h);
+        }
+    };
+
     const_iterator from, to;
 };
 
-struct atom;
-struct environment;
-std::shared_ptr<environment> clone_environment(
-        const std::shared_ptr<environment> &env);
+/** interned symbol. Every distinct name is stored once in a global table,
+    symbols themselves are just pointers to the table entries, so comparing
+    and hashing them never touches the characters of the name. Looking up
+    a name already in the table does not allocate, so the reader interns
+    tokens straight from the source text */
+class symbol {
+public:
+    symbol() : e(nullptr) {}
+    explicit symbol(const str_view &name) : e(intern(name)) {}
+    explicit symbol(const std::string &name) : e(intern(str_view(name))) {}
+    explicit symbol(const char *name)
+        : e(intern(str_view(name, name + std::strlen(name)))) {}
+
+    const std::string &name() const {
+        static const std::string none;
+        return e ? e->name : none;
+    }
 
-/// list
-struct list {
-    list() : car(), cdr() {};
+    /// small dense integer, unique for each interned name
+    size_t id() const {
+        return e ? e->id : 0;
+    }
 
-    list(const list &src);
+    bool null() const {
+        return !e;
+    }
 
-    /// evaluates a list, pushes resulting values into new list
-    list(const list &src, environment &env);
+    bool operator==(const symbol &other) const {
+        return e == other.e;
+    }
 
-    list(list &&src) : car(std::move(src.car)), cdr(std::move(src.cdr)) {
-        src.clear();
+    bool operator!=(const symbol &other) const {
+        return e != other.e;
     }
 
-    void clear() {
-        car.reset();
-        cdr.reset();
+    bool operator<(const symbol &other) const {
+        return id() < other.id();
     }
 
-    size_t size() const {
-        if (car) {
-            if (cdr)
-                return 1 + cdr->size();
-            else
-                return 1;
-        } else {
-            return 0;
+    struct hash {
+        size_t operator()(const symbol &s) const {
+            return s.id();
         }
-    }
+    };
 
-    bool empty() const {
-        return !car && !cdr;
-    }
+private:
+    struct entry {
+        std::string name;
+        size_t id;
+    };
 
-    static const list Empty;
+    // entries live in a deque so their addresses stay valid forever, the
+    // index keys are views of the names stored in them
+    struct table {
+        typedef std::unordered_map<str_view, const entry *, str_view::hash>
+                index_map;
 
-    const atom &operator[](size_t idx) const;
+        const entry *intern(const str_view &name) {
+            std::lock_guard<std::mutex> guard(lock);
+            index_map::iterator i = index.find(name);
+            if (i != index.end())
+                return i->second;
 
-    atom &operator[](size_t idx);
+            // id 0 is reserved for the null symbol
+            entries.push_back(entry{name.str(), entries.size() + 1});
+            const entry *e = &entries.back();
+            index.insert(std::make_pair(str_view(e->name), e));
+            return e;
+        }
 
-    list &operator=(list &&other);
+        std::mutex lock;
+        std::deque<entry> entries;
+        index_map index;
+    };
 
-    const atom &front() const;
-    atom &front();
+    static const entry *intern(const str_view &name) {
+        static table symbols;
+        return symbols.intern(name);
+    }
 
-    const list &rest() const {
-        if (cdr)
-            return *cdr;
+    const entry *e;
+};
 
-        return list::Empty;
+/** size class allocator for the small objects the interpreter allocates
+    all the time (list blocks, frames, compiled code). Memory is taken from
+    the system in slabs, freed blocks go to a free list of their size class
+    and are handed out again. Every thread allocates from a pool of its
+    own, blocks freed by another thread simply join that thread's lists */
+class pool {
+public:
+    static const size_t granularity = 16;
+    static const size_t classes = 16;
+    static const size_t slab_size = 64 * 1024;
+
+    // never destroyed - static objects may still release blocks at exit
+    static pool &instance() {
+        static thread_local pool *p = new pool();
+        return *p;
     }
 
-    list eval_rest();
+    void *allocate(size_t size) {
+        size_t cls = size_class(size);
+        if (cls >= classes)
+            return ::operator new(size);
 
-    struct const_iterator {
-        const_iterator(const list * l = nullptr) : node(l) {
-            // step to next if the current has nil car empty, in fact
-            if (node && !node->car)
-                node = nullptr;
-        }
+        if (!free[cls])
+            refill(cls);
+
+        block *b = free[cls];
+        free[cls] = b->next;
+        return b;
+    }
 
-        const atom &operator*() {
-            assert(node);
-            return node->front();
+    void deallocate(void *p, size_t size) {
+        size_t cls = size_class(size);
+        if (cls >= classes) {
+            ::operator delete(p);
+            return;
         }
 
-        const atom *operator->() {
-            assert(node);
-            return &node->front();
+        block *b = static_cast<block *>(p);
+        b->next = free[cls];
+        free[cls] = b;
+    }
+
+private:
+    struct block {
+        block *next;
+    };
+
+    pool() : free() {}
+
+    static size_t size_class(size_t size) {
+        return size ? (size - 1) / granularity : 0;
+    }
+
+    void refill(size_t cls) {
+        size_t size = (cls + 1) * granularity;
+        char *slab = static_cast<char *>(::operator new(slab_size));
+        for (size_t off = 0; off + size <= slab_size; off += size) {
+            block *b = reinterpret_cast<block *>(slab + off);
+            b->next = free[cls];
+            free[cls] = b;
         }
+    }
+
+    block *free[classes];
+};
+
+/// base for classes whose instances are allocated from the pool
+struct pooled {
+    static void *operator new(size_t size) {
+        return pool::instance().allocate(size);
+    }
+
+    static void operator delete(void *p, size_t size) {
+        pool::instance().deallocate(p, size);
+    }
+};
+
+/// standard allocator interface to the pool, for containers and shared_ptr
+template <class T>
+struct pool_allocator {
+    typedef T value_type;
+
+    pool_allocator() {}
+    template <class U> pool_allocator(const pool_allocator<U> &) {}
+
+    T *allocate(size_t n) {
+        return static_cast<T *>(pool::instance().allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T *p, size_t n) {
+        pool::instance().deallocate(p, n * sizeof(T));
+    }
+
+    template <class U> bool operator==(const pool_allocator<U> &) const {
+        return true;
+    }
+
+    template <class U> bool operator!=(const pool_allocator<U> &) const {
+        return false;
+    }
+};
+
+/** bump allocator for temporaries that all die together. Allocation just
+    advances a pointer in the current chunk, nothing is freed individually,
+    release() returns everything in one shot */
+class arena {
+public:
+    explicit arena(size_t chunk_size = 4096)
+        : chunk_size(chunk_size), cur(nullptr), left(0)
+    {}
+
+    arena(const arena &) = delete;
+    arena &operator=(const arena &) = delete;
+
+    ~arena() {
+        release();
+    }
 
-        const_iterator operator++() {
-            if (end())
-                return *this;
-            node = node->cdr.get();
-            return *this;
+    void *allocate(size_t size) {
+        const size_t align = alignof(std::max_align_t);
+        size = (size + align - 1) & ~(align - 1);
+
+        if (size > left) {
+            size_t bytes = std::max(size, chunk_size);
+            chunks.push_back(static_cast<char *>(::operator new(bytes)));
+            cur = chunks.back();
+            left = bytes;
         }
 
+        void *p = cur;
+        cur += size;
+        left -= size;
+        return p;
+    }
+
+    void release() {
+        for (char *c : chunks)
+            ::operator delete(c);
+        chunks.clear();
+        cur = nullptr;
+        left = 0;
+    }
+
+private:
+    size_t chunk_size;
+    char *cur;
+    size_t left;
+    std::vector<char *> chunks;
+};
+
+/// standard allocator interface to an arena, deallocation is a no-op
+template <class T>
+struct arena_allocator {
+    typedef T value_type;
+
+    arena_allocator(arena &a) : a(&a) {}
+    template <class U> arena_allocator(const arena_allocator<U> &o) : a(o.a) {}
+
+    T *allocate(size_t n) {
+        return static_cast<T *>(a->allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T *, size_t) {}
+
+    template <class U> bool operator==(const arena_allocator<U> &o) const {
+        return a == o.a;
+    }
+
+    template <class U> bool operator!=(const arena_allocator<U> &o) const {
+        return a != o.a;
+    }
+
+    arena *a;
+};
+
+class heap;
+
+/** base of all garbage collected objects. The heap links every object it
+    allocated into one list; a collection marks what is reachable from the
+    roots and deletes the rest */
+struct object : pooled {
+    object() : next(nullptr), marked(false) {}
+    object(const object &) : pooled(), next(nullptr), marked(false) {}
+    virtual ~object() {}
+
+    /// marks all objects referenced from this one
+    virtual void trace(heap &h) const = 0;
+
+    /// bytes owned by the object, used to pace collections
+    virtual size_t footprint() const = 0;
+
+    object *next;
+    mutable bool marked;
+};
+
+/// anything outside of the heap that holds references into it
+struct root_set {
+    virtual void trace(heap &h) const = 0;
+};
+
+/// holds references into the heap without keeping their targets alive
+struct weak_set {
+    /// drops references to objects the current collection did not mark
+    virtual void prune(const heap &h) = 0;
+};
+
+struct atom;
+struct environment;
+struct code;
+struct frame;
+struct closure;
+struct bignum;
+struct packed;
+struct task;
+struct memo;
+struct hash_map;
+struct tree_node;
+struct rope;
+struct text_builder;
+
+/** immutable list stored in contiguous blocks. A list is a position in a
+    block, its elements run to the end of the block and continue with the
+    list the block links to. Lists built front to back (parsed forms,
+    arguments, results of builtins) occupy one block, so length, indexing
+    and iteration are array operations; consing fills blocks from the back
+    and only links a new block when the current one is full. Blocks are
+    garbage collected and shared, copying a list or taking its rest is O(1)
+    and so is its length */
+class list {
+    struct block;
+
+public:
+    list() : b(nullptr), off(0) {}
+
+    size_t size() const;
+
+    bool empty() const {
+        return !b;
+    }
+
+    static const list Empty;
+
+    const atom &operator[](size_t idx) const;
+
+    const atom &front() const;
+
+    list rest() const;
+
+    /// new list with a in front, sharing all elements of this one
+    list cons(const atom &a) const;
+
+    struct const_iterator {
+        const_iterator(const block *b = nullptr, size_t off = 0)
+            : b(b), off(off)
+        {}
+
+        const atom &operator*();
+        const atom *operator->();
+        const_iterator operator++();
+
         const_iterator operator++(int) {
             const_iterator last = *this;
             operator++();
@@ -143,285 +449,731 @@ struct list {
         }
 
         bool operator!=(const const_iterator &other) const {
-            return node != other.node;
+            return b != other.b || off != other.off;
         }
 
         bool operator==(const const_iterator &other) const {
-            return node == other.node;
+            return b == other.b && off == other.off;
         }
 
         bool end() {
-            return !node;
+            return !b;
         }
 
-        const list *node;
+        const block *b;
+        size_t off;
     };
 
     const_iterator begin() const {
-        return const_iterator(this);
+        return const_iterator(b, off);
     }
 
     const_iterator end() const {
         return const_iterator();
     }
 
-    void pop_front();
+    class builder;
+
+private:
+    friend class heap;
+    friend class atom;
+    friend class image;
+
+    list(block *b, size_t off) : b(b), off(off) {}
+
+    block *b;
+    size_t off;
+};
+
+/** constructs a list front to back into a single block. Elements are only
+    appended here, before anyone else can see them, which keeps lists
+    immutable after that */
+class list::builder {
+public:
+    builder() : b(nullptr) {}
 
     void push_back(const atom &a);
     void push_back(atom &&a);
-    void append(atom &&a);
 
-    std::unique_ptr<atom> car;
-    std::unique_ptr<list> cdr;
+    /// finishes the list, optionally sharing rest as its tail
+    list done(const list &rest = list::Empty);
+
+private:
+    void start();
+
+    block *b;
 };
 
 const list list::Empty;
 
-bool toNumber(str_view val, int &i) {
-    try {
-        i = std::stoi(val.str(), 0, 0);
-        return true;
-    } catch (const std::invalid_argument &) {
-        return false;
-    }
+/// outcome of scanning a token for a numeric literal
+enum scan_result {
+    SCAN_NONE,      ///< not a number, the token is a symbol
+    SCAN_INT,       ///< integer literal, stored in i
+    SCAN_REAL,      ///< floating point literal, stored in d
+    SCAN_BIG        ///< integer literal too large for int64_t
+};
+
+/// value of a digit in bases up to 16, 16 for anything else
+unsigned digitValue(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return 16;
 }
 
-struct environment;
+/** splits an integer literal into its sign, base and digits - decimal,
+    hexadecimal with 0x prefix or octal with a leading zero. Returns false
+    when there are no digits to read */
+bool integerPrefix(str_view val, bool &neg, unsigned &base,
+                   str_view &digits)
+{
+    str_view::const_iterator p = val.begin(), e = val.end();
 
-/** atomic value - simple variant type implementation */
-class atom {
-public:
-    // value type
-    enum atom_type {
-        NIL = 0,
-        INT = 1,
-        STR = 2,
-        LST = 3,
-        PRC = 4,
-        LMB = 5
-    };
+    neg = false;
+    if (p != e && (*p == '+' || *p == '-')) {
+        neg = *p == '-';
+        ++p;
+    }
 
-    static const char* strtype(atom_type t) {
-        switch (t) {
-        case NIL: return "NIL";
-        case INT: return "INT";
-        case STR: return "STR";
-        case LST: return "LST";
-        case PRC: return "PRC";
-        case LMB: return "LMB";
+    if (p == e)
+        return false;
+
+    base = 10;
+    if (*p == '0' && p + 1 != e) {
+        ++p;
+        base = 8;
+        if (*p == 'x' || *p == 'X') {
+            base = 16;
+            if (++p == e)
+                return false;
         }
-        return "<INVALID>";
     }
 
-    typedef std::string string;
-    typedef std::function<atom (environment &env, const atom &)> proc;
+    digits = str_view(p, e);
+    return true;
+}
 
-    atom_type type() const {
-        return t;
-    }
+/// decimal digits, a fraction and an exponent, at least one of the last two
+bool isReal(str_view val) {
+    str_view::const_iterator p = val.begin(), e = val.end();
+    if (p != e && (*p == '+' || *p == '-'))
+        ++p;
+
+    size_t mantissa = 0;
+    bool fraction = false, exponent = false;
 
-    atom() : t(NIL) {
+    for (; p != e && ::isdigit(*p); ++p)
+        ++mantissa;
+
+    if (p != e && *p == '.') {
+        fraction = true;
+        for (++p; p != e && ::isdigit(*p); ++p)
+            ++mantissa;
     }
 
-    atom(atom_type t) : t(t) {
-        switch (t) {
-        case NIL:
-            return;
-        case INT:
-            new (&iv) int();
-            return;
-        case STR:
-            new (&sv) string();
-            return;
-        case LMB:
-        case LST:
-            new (&lv) list();
-            return;
-        case PRC:
-            new (&fv) proc();
-            return;
-        }
+    if (mantissa && p != e && (*p == 'e' || *p == 'E')) {
+        if (++p != e && (*p == '+' || *p == '-'))
+            ++p;
+        str_view::const_iterator digits = p;
+        while (p != e && ::isdigit(*p))
+            ++p;
+        // an exponent marker needs digits after it, 1.5e is no number
+        if (p == digits)
+            return false;
+        exponent = true;
     }
 
-    atom(atom &&src) : t(src.t) {
-        switch (t) {
-        case NIL:
-            break;
-        case INT:
-            new (&iv) int(std::move(src.iv));
-            break;
-        case STR:
-            new (&sv) string(std::move(src.sv));
-            break;
-        case LMB:
-            env = std::move(src.env);
-        case LST:
-            new (&lv) list(std::move(src.lv));
-            break;
-        case PRC:
-            new (&fv) proc(std::move(src.fv));
-            break;
+    return p == e && mantissa && (fraction || exponent);
+}
+
+/** scans the whole token as a numeric literal - an integer as read by
+    integerPrefix or a decimal floating point number. Works on the
+    characters in place and never throws nor allocates, as most tokens
+    turn out to be symbols */
+scan_result scanNumber(str_view val, int64_t &i, double &d) {
+    if (isReal(val)) {
+        // strtod wants a terminated string, real literals are short
+        char buf[64];
+        if (val.size() < sizeof(buf)) {
+            std::copy(val.begin(), val.end(), buf);
+            buf[val.size()] = 0;
+            d = std::strtod(buf, nullptr);
+        } else {
+            d = std::strtod(val.str().c_str(), nullptr);
         }
-        // don't call clear here!
-        src.t = NIL;
+        return SCAN_REAL;
     }
 
-    atom(const atom &src) : t(src.t) {
-        switch (t) {
-        case NIL:
-            return;
-        case INT:
-            new (&iv) int(src.iv);
-            return;
-        case STR:
-            new (&sv) string(src.sv);
-            return;
-        case LMB:
-            env = clone_environment(src.env);
-        case LST:
-            new (&lv) list(src.lv);
-            return;
-        case PRC:
-            new (&fv) proc(src.fv);
-            return;
-            return;
+    bool neg;
+    unsigned base;
+    str_view digits;
+    if (!integerPrefix(val, neg, base, digits))
+        return SCAN_NONE;
+
+    // magnitude is accumulated unsigned, so INT64_MIN is representable
+    const uint64_t limit = neg ? uint64_t(INT64_MAX) + 1 : INT64_MAX;
+
+    uint64_t acc = 0;
+    bool overflow = false;
+    for (char c : digits) {
+        unsigned dv = digitValue(c);
+        if (dv >= base)
+            return SCAN_NONE;
+
+        // keep scanning past an overflow, a later non-digit makes it a symbol
+        if (!overflow) {
+            overflow = acc > (limit - dv) / base;
+            acc = acc * base + dv;
         }
     }
 
-    atom(int i) {
-        t = INT;
-        iv = i;
+    if (overflow)
+        return SCAN_BIG;
+
+    i = neg ? (acc == limit ? INT64_MIN : -static_cast<int64_t>(acc))
+            : static_cast<int64_t>(acc);
+    return SCAN_INT;
+}
+
+/** shortest text reading back as the same double, always with a fraction
+    or exponent so it is not taken for an integer */
+std::string realRepr(double d) {
+    if (d != d)
+        return "nan";
+    if (d == std::numeric_limits<double>::infinity())
+        return "inf";
+    if (d == -std::numeric_limits<double>::infinity())
+        return "-inf";
+
+    char buf[32];
+    for (int precision = 15; precision <= 17; ++precision) {
+        std::snprintf(buf, sizeof(buf), "%.*g", precision, d);
+        if (std::strtod(buf, nullptr) == d)
+            break;
     }
 
-    atom(const string &s) {
-        t = STR;
-        new (&sv) string(s);
+    std::string s(buf);
+    if (s.find_first_of(".e") == std::string::npos)
+        s += ".0";
+    return s;
+}
+
+/** signed arbitrary precision integer value. The magnitude is kept in 32
+    bit limbs, least significant first, without leading zero limbs, and
+    zero is never negative */
+struct bigint {
+    typedef std::vector<uint32_t> limbs;
+
+    bigint() : neg(false) {}
+
+    explicit bigint(int64_t i) : neg(i < 0) {
+        uint64_t u = neg ? 0 - static_cast<uint64_t>(i) : i;
+        for (; u; u >>= 32)
+            mag.push_back(static_cast<uint32_t>(u));
     }
 
-    atom(const char *c) {
-        t = STR;
-        new (&sv) string(c);
+    /// reads an integer literal, see integerPrefix
+    static bigint parse(str_view val) {
+        bigint r;
+        bool neg;
+        unsigned base;
+        str_view digits;
+        if (!integerPrefix(val, neg, base, digits))
+            return r;
+
+        for (char c : digits)
+            r.mulAdd(base, digitValue(c));
+        r.neg = neg && !r.zero();
+        return r;
     }
 
-    atom(const proc &p) {
-        t = PRC;
-        new (&fv) proc(p);
+    bool zero() const {
+        return mag.empty();
     }
 
-    atom(const list &l) {
-        t = LST;
-        new (&lv) list(l);
+    /// stores the value to i if it is in range of int64_t
+    bool fits(int64_t &i) const {
+        if (mag.size() > 2)
+            return false;
+
+        uint64_t u = 0;
+        for (size_t k = mag.size(); k--;)
+            u = u << 32 | mag[k];
+
+        if (neg) {
+            if (u > uint64_t(INT64_MAX) + 1)
+                return false;
+            i = u == uint64_t(INT64_MAX) + 1 ? INT64_MIN
+                                             : -static_cast<int64_t>(u);
+        } else {
+            if (u > uint64_t(INT64_MAX))
+                return false;
+            i = static_cast<int64_t>(u);
+        }
+        return true;
     }
 
-    atom(const list &l, environment &env) {
-        t = LST;
-        new (&lv) list(l, env);
+    double toDouble() const {
+        double r = 0;
+        for (size_t k = mag.size(); k--;)
+            r = r * 4294967296.0 + mag[k];
+        return neg ? -r : r;
     }
 
-    atom(list &&l) {
-        t = LST;
-        new (&lv) list(std::move(l));
+    std::string str() const {
+        if (zero())
+            return "0";
+
+        // peel off nine decimal digits at a time
+        bigint rest(*this);
+        std::vector<uint32_t> chunks;
+        while (!rest.zero())
+            chunks.push_back(rest.divSmall(1000000000));
+
+        std::string s = neg ? "-" : "";
+        s += std::to_string(chunks.back());
+        for (size_t k = chunks.size() - 1; k--;) {
+            std::string c = std::to_string(chunks[k]);
+            s.append(9 - c.size(), '0');
+            s += c;
+        }
+        return s;
     }
 
-    ~atom() {
-        clear();
+    /// this = this * m + a
+    void mulAdd(uint32_t m, uint32_t a) {
+        uint64_t carry = a;
+        for (uint32_t &l : mag) {
+            carry += uint64_t(l) * m;
+            l = static_cast<uint32_t>(carry);
+            carry >>= 32;
+        }
+        if (carry)
+            mag.push_back(static_cast<uint32_t>(carry));
     }
 
-    atom &operator=(const proc &p) {
-        clear();
-        t = PRC;
-        new (&fv) proc(p);
-        return *this;
+    /// divides the magnitude by d in place, returns the remainder
+    uint32_t divSmall(uint32_t d) {
+        uint64_t rem = 0;
+        for (size_t k = mag.size(); k--;) {
+            uint64_t cur = rem << 32 | mag[k];
+            mag[k] = static_cast<uint32_t>(cur / d);
+            rem = cur % d;
+        }
+        trim();
+        return static_cast<uint32_t>(rem);
     }
 
-    atom &operator=(atom &&a) {
-        clear();
+    static int compare(const bigint &a, const bigint &b) {
+        if (a.neg != b.neg)
+            return a.neg ? -1 : 1;
+        int m = compareMag(a.mag, b.mag);
+        return a.neg ? -m : m;
+    }
 
-        t = a.t;
-        switch (a.t) {
-        case NIL:
-            break;
-        case INT:
-            iv = a.iv;
-            break;
-        case STR:
-            new (&sv) std::string(std::move(a.sv));
-            break;
-        case LMB:
-            env = std::move(a.env);
-        case LST:
-            new (&lv) list(std::move(a.lv));
-            break;
-        case PRC:
-            new (&fv) proc(std::move(a.fv));
-            break;
-            break;
+    static bigint add(const bigint &a, const bigint &b) {
+        bigint r;
+        if (a.neg == b.neg) {
+            r.mag = addMag(a.mag, b.mag);
+            r.neg = a.neg;
+        } else if (compareMag(a.mag, b.mag) >= 0) {
+            r.mag = subMag(a.mag, b.mag);
+            r.neg = a.neg;
+        } else {
+            r.mag = subMag(b.mag, a.mag);
+            r.neg = b.neg;
         }
-
-        a.t = NIL;
-        return *this;
+        r.neg = r.neg && !r.zero();
+        return r;
     }
 
-    static const atom True;
-    static const atom False;
-    static const atom Nil;
+    static bigint sub(const bigint &a, bigint b) {
+        b.neg = !b.neg && !b.zero();
+        return add(a, b);
+    }
 
-    void clear() {
-        switch (t) {
-        case NIL:
-            break;
-        case INT:
-            break;
-        case STR:
-            sv.~string();
-            break;
-        case LMB:
-            env.reset();
-        case LST:
-            lv.~list();
-            break;
-        case PRC:
-            fv.~proc();
-            break;
+    static bigint mul(const bigint &a, const bigint &b) {
+        bigint r;
+        if (a.zero() || b.zero())
+            return r;
+
+        r.mag.assign(a.mag.size() + b.mag.size(), 0);
+        for (size_t i = 0; i < a.mag.size(); ++i) {
+            uint64_t carry = 0;
+            for (size_t j = 0; j < b.mag.size(); ++j) {
+                carry += uint64_t(a.mag[i]) * b.mag[j] + r.mag[i + j];
+                r.mag[i + j] = static_cast<uint32_t>(carry);
+                carry >>= 32;
+            }
+            r.mag[i + b.mag.size()] = static_cast<uint32_t>(carry);
+        }
+        r.trim();
+        r.neg = a.neg != b.neg;
+        return r;
+    }
+
+    /** a / b truncated towards zero, the remainder with the sign of a is
+        stored to rem. Long division as in Knuth's algorithm D, b must not
+        be zero */
+    static bigint div(const bigint &a, const bigint &b, bigint &rem) {
+        bigint q;
+        if (compareMag(a.mag, b.mag) < 0) {
+            rem = a;
+            return q;
+        }
+
+        if (b.mag.size() == 1) {
+            q = a;
+            rem = bigint(q.divSmall(b.mag[0]));
+        } else {
+            q.mag = divMag(a.mag, b.mag, rem.mag);
+            rem.trim();
+        }
+        q.neg = a.neg != b.neg && !q.zero();
+        rem.neg = a.neg && !rem.zero();
+        return q;
+    }
+
+    bool neg;
+    limbs mag;
+
+private:
+    void trim() {
+        while (!mag.empty() && !mag.back())
+            mag.pop_back();
+        if (mag.empty())
+            neg = false;
+    }
+
+    static int compareMag(const limbs &a, const limbs &b) {
+        if (a.size() != b.size())
+            return a.size() < b.size() ? -1 : 1;
+        for (size_t k = a.size(); k--;)
+            if (a[k] != b[k])
+                return a[k] < b[k] ? -1 : 1;
+        return 0;
+    }
+
+    static limbs addMag(const limbs &a, const limbs &b) {
+        const limbs &l = a.size() >= b.size() ? a : b;
+        const limbs &s = a.size() >= b.size() ? b : a;
+        limbs r(l.size() + 1);
+        uint64_t carry = 0;
+        for (size_t k = 0; k < l.size(); ++k) {
+            carry += uint64_t(l[k]) + (k < s.size() ? s[k] : 0);
+            r[k] = static_cast<uint32_t>(carry);
+            carry >>= 32;
+        }
+        r[l.size()] = static_cast<uint32_t>(carry);
+        if (!r.back())
+            r.pop_back();
+        return r;
+    }
+
+    /** quotient of magnitudes a >= b, b of at least two limbs. Both are
+        shifted so that the top bit of b is set, which keeps every guessed
+        quotient digit at most two too large */
+    static limbs divMag(const limbs &a, const limbs &b, limbs &rem) {
+        const uint64_t base = uint64_t(1) << 32;
+        size_t n = b.size(), m = a.size() - n;
+        int shift = __builtin_clz(b.back());
+
+        limbs u(a.size() + 1), v(n);
+        for (size_t k = n; k-- > 1;)
+            v[k] = b[k] << shift | (shift ? b[k - 1] >> (32 - shift) : 0);
+        v[0] = b[0] << shift;
+        u[a.size()] = shift ? a.back() >> (32 - shift) : 0;
+        for (size_t k = a.size(); k-- > 1;)
+            u[k] = a[k] << shift | (shift ? a[k - 1] >> (32 - shift) : 0);
+        u[0] = a[0] << shift;
+
+        limbs q(m + 1);
+        for (size_t j = m + 1; j-- > 0;) {
+            uint64_t top = uint64_t(u[j + n]) << 32 | u[j + n - 1];
+            uint64_t qhat = top / v[n - 1], rhat = top % v[n - 1];
+            while (qhat >= base
+                   || qhat * v[n - 2] > (rhat << 32 | u[j + n - 2])) {
+                --qhat;
+                rhat += v[n - 1];
+                if (rhat >= base)
+                    break;
+            }
+
+            // u -= qhat * v, shifted by j limbs
+            int64_t borrow = 0, t;
+            for (size_t i = 0; i < n; ++i) {
+                uint64_t p = qhat * v[i];
+                t = int64_t(u[i + j]) - borrow - int64_t(p & 0xffffffff);
+                u[i + j] = static_cast<uint32_t>(t);
+                borrow = int64_t(p >> 32) - (t >> 32);
+            }
+            t = int64_t(u[j + n]) - borrow;
+            u[j + n] = static_cast<uint32_t>(t);
+
+            // the guess was one too large, add v back
+            if (t < 0) {
+                --qhat;
+                uint64_t carry = 0;
+                for (size_t i = 0; i < n; ++i) {
+                    carry += uint64_t(u[i + j]) + v[i];
+                    u[i + j] = static_cast<uint32_t>(carry);
+                    carry >>= 32;
+                }
+                u[j + n] += static_cast<uint32_t>(carry);
+            }
+            q[j] = static_cast<uint32_t>(qhat);
+        }
+
+        rem.assign(n, 0);
+        for (size_t k = 0; k < n; ++k)
+            rem[k] = u[k] >> shift | (shift ? u[k + 1] << (32 - shift) : 0);
+        while (!q.empty() && !q.back())
+            q.pop_back();
+        return q;
+    }
+
+    /// a - b for a >= b
+    static limbs subMag(const limbs &a, const limbs &b) {
+        limbs r(a.size());
+        int64_t borrow = 0;
+        for (size_t k = 0; k < a.size(); ++k) {
+            int64_t cur = int64_t(a[k]) - (k < b.size() ? b[k] : 0) - borrow;
+            borrow = cur < 0;
+            r[k] = static_cast<uint32_t>(cur + (borrow << 32));
         }
-        t = NIL;
+        while (!r.empty() && !r.back())
+            r.pop_back();
+        return r;
+    }
+};
+
+struct environment;
+
+/** native function. Arguments are evaluated by the VM and passed as a span
+    of its value stack, fixed arity functions get them as parameters. The
+    span is only valid until the function calls back into the interpreter.
+    Descriptors are static and atoms of type PRC just point to them */
+struct builtin {
+    typedef atom (*fixed0)(environment &env);
+    typedef atom (*fixed1)(environment &env, const atom &a);
+    typedef atom (*fixed2)(environment &env, const atom &a, const atom &b);
+    typedef atom (*fixed3)(environment &env, const atom &a, const atom &b,
+                           const atom &c);
+    typedef atom (*variadic)(environment &env, const atom *args, size_t argc);
+
+    enum kind {
+        FIXED,
+        VARIADIC,
+        SPECIAL    ///< special form, compiled inline and never called
+    };
+
+    builtin(const char *name, fixed0 f) : name(name), k(FIXED), arity(0) {
+        fn.f0 = f;
+    }
+
+    builtin(const char *name, fixed1 f) : name(name), k(FIXED), arity(1) {
+        fn.f1 = f;
+    }
+
+    builtin(const char *name, fixed2 f) : name(name), k(FIXED), arity(2) {
+        fn.f2 = f;
+    }
+
+    builtin(const char *name, fixed3 f) : name(name), k(FIXED), arity(3) {
+        fn.f3 = f;
+    }
+
+    /// arity is the minimal number of arguments
+    builtin(const char *name, variadic f, size_t arity = 0)
+        : name(name), k(VARIADIC), arity(arity)
+    {
+        fn.fv = f;
     }
 
-    atom &operator=(const atom &src) {
-        clear();
-        t = src.t;
+    /// marks name as a special form
+    explicit builtin(const char *name)
+        : name(name), k(SPECIAL), arity(0)
+    {
+        fn.fv = nullptr;
+    }
+
+    bool special() const {
+        return k == SPECIAL;
+    }
+
+    atom call(environment &env, const atom *args, size_t argc) const;
+
+    const char *name;
+    kind k;
+    size_t arity;
+
+    union {
+        fixed0 f0;
+        fixed1 f1;
+        fixed2 f2;
+        fixed3 f3;
+        variadic fv;
+    } fn;
+};
+
+/** atomic value - compact tagged variant. Integers, symbols and builtins are
+    stored inline, lists and lambdas point to garbage collected objects */
+class atom {
+public:
+    // value type
+    enum atom_type : uint8_t {
+        NIL = 0,
+        INT = 1,
+        SYM = 2,
+        LST = 3,
+        PRC = 4,
+        LMB = 5,
+        FLT = 6,
+        BIG = 7,
+        VEC = 8,
+        FUT = 9,
+        MEM = 10,
+        MAP = 11,
+        OMP = 12,
+        STR = 13,
+        BLD = 14
+    };
 
+    static const char* strtype(atom_type t) {
         switch (t) {
-        case NIL:
-            return *this;
-        case INT:
-            new (&iv) int(src.iv);
-            return *this;
-        case STR:
-            new (&sv) string(src.sv);
-            return *this;
-        case LMB:
-            env = clone_environment(src.env);
-        case LST:
-            new (&lv) list(src.lv);
-            return *this;
-        case PRC:
-            new (&fv) proc(src.fv);
-            return *this;
+        case NIL: return "NIL";
+        case INT: return "INT";
+        case SYM: return "SYM";
+        case LST: return "LST";
+        case PRC: return "PRC";
+        case LMB: return "LMB";
+        case FLT: return "FLT";
+        case BIG: return "BIG";
+        case VEC: return "VEC";
+        case FUT: return "FUT";
+        case MEM: return "MEM";
+        case MAP: return "MAP";
+        case OMP: return "OMP";
+        case STR: return "STR";
+        case BLD: return "BLD";
         }
-        return *this;
+        return "<INVALID>";
+    }
+
+    typedef std::string string;
+
+    atom_type type() const {
+        return t;
+    }
+
+    atom() : t(NIL), n(0), p(nullptr) {
+    }
+
+    atom(atom_type t) : t(t), n(0), p(nullptr) {
+    }
+
+    atom(int i) : t(INT), n(0) {
+        iv = i;
+    }
+
+    atom(int64_t i) : t(INT), n(0) {
+        iv = i;
+    }
+
+    atom(double d) : t(FLT), n(0) {
+        dv = d;
+    }
+
+    /// integer of any size, demoted to INT whenever it fits
+    static atom big(bigint &&v);
+
+    /// new packed vector of n elements, p points to it for filling in
+    static atom vec(bool real, size_t n, packed *&p);
+
+    atom(const symbol &s) : t(SYM), n(0) {
+        new (&sy) symbol(s);
+    }
+
+    atom(const string &s) : t(SYM), n(0) {
+        new (&sy) symbol(s);
+    }
+
+    atom(const char *c) : t(SYM), n(0) {
+        new (&sy) symbol(c);
+    }
+
+    explicit atom(const builtin *b) : t(PRC), n(0) {
+        bi = b;
+    }
+
+    explicit atom(task *f) : t(FUT), n(0) {
+        tk = f;
+    }
+
+    explicit atom(memo *m) : t(MEM), n(0) {
+        mm = m;
+    }
+
+    explicit atom(hash_map *m) : t(MAP), n(0) {
+        hm = m;
+    }
+
+    /// string of the characters of s
+    static atom text(const str_view &s);
+
+    /// string of the characters of r
+    static atom text(const rope *r);
+
+    explicit atom(text_builder *b) : t(BLD), n(0) {
+        tb = b;
+    }
+
+    /// ordered map with the given root, null for an empty one
+    static atom ordered(const tree_node *root) {
+        atom a(OMP);
+        a.tn = root;
+        return a;
+    }
+
+    atom(const list &l) : t(LST) {
+        lb = l.b;
+        n = static_cast<uint32_t>(l.off);
+    }
+
+    static const atom True;
+    static const atom False;
+    static const atom Nil;
+
+    void clear() {
+        *this = atom();
     }
 
     //// Will not construct a list!
-    atom(const str_view &token) {
+    atom(const str_view &token) : n(0) {
         // first char == '(' - a list. Descend while tokenizing
         // is it a number?
-        if (toNumber(token, iv)) {
+        switch (scanNumber(token, iv, dv)) {
+        case SCAN_INT:
             t = INT;
-        } else {
-            new (&sv) std::string();
-            sv = token.str();
-            t = STR;
+            break;
+        case SCAN_REAL:
+            t = FLT;
+            break;
+        case SCAN_BIG:
+            *this = big(bigint::parse(token));
+            break;
+        case SCAN_NONE:
+            if (token.size() && *token.begin() == '"') {
+                *this = literal(token);
+                break;
+            }
+            new (&sy) symbol(token);
+            t = SYM;
+            break;
         }
     }
 
@@ -432,275 +1184,290 @@ public:
                                         + strtype(t));
     }
 
-    int asInt() const {
+    int64_t asInt() const {
         expect(INT);
         return iv;
     }
 
-    const string &asString() const {
-        expect(STR);
-        return sv;
+    bool isNumber() const {
+        return t == INT || t == FLT || t == BIG;
     }
 
-    const list &asList() const {
-        expect(LST);
-        return lv;
+    /// any number converted to a double
+    double asReal() const;
+
+    /// any integer widened to a bigint
+    bigint asBig() const;
+
+    const symbol &asSymbol() const {
+        expect(SYM);
+        return sy;
     }
 
-    const atom &operator[](size_t idx) const {
+    list asList() const {
         expect(LST);
-        if (idx >= size())
-            return Nil;
-        return lv[idx];
+        return list(lb, n);
     }
 
-    int &asInt() {
-        expect(INT);
-        return iv;
+    const atom &operator[](size_t idx) const {
+        return asList()[idx];
     }
 
-    string &asString() {
-        expect(STR);
-        return sv;
+    const builtin &asBuiltin() const {
+        expect(PRC);
+        return *bi;
     }
 
-    list &asList() {
-        expect(LST);
-        return lv;
+    const packed &asPacked() const {
+        expect(VEC);
+        return *pv;
     }
 
-    atom &operator[](int idx) {
-        expect(LST);
-        return lv[idx];
+    task &asTask() const {
+        expect(FUT);
+        return *tk;
     }
 
-    size_t size() const {
-        return lv.size();
+    hash_map &asMap() const {
+        expect(MAP);
+        return *hm;
     }
 
-    void push_back(const atom &a) {
-        asList().push_back(a);
+    const tree_node *asTree() const {
+        expect(OMP);
+        return tn;
     }
 
-    std::string repr(const std::string &indent = "") const {
-        std::string result;
-        switch (t) {
-        case NIL:
-            return "nil";
-        case INT:
-            return std::to_string(iv);
-        case STR:
-            return '"' + sv + '"';
-        case LMB:
-            result = "<Lambda>";
-        case LST: {
-            result += "(";
-            bool frst = true;
-            for (const atom& a : lv) {
-                if (!frst) result += ' ';
-                frst = false;
-                result += a.repr();
-            }
-            result += ")";
-            return result;
-        }
-        case PRC:
-            return "PROC";
-        }
-        return "<INVALID>";
-    }
+    /// longest string kept in the atom itself
+    static const size_t short_text = 8;
 
-    atom eval(environment &env) const;
+    size_t textSize() const;
 
-    atom operator()(environment &env, const atom &values);
+    /** characters of a string. Short strings are kept in the atom itself,
+        so the view is only valid as long as the atom is */
+    str_view asText() const;
+
+    /// the string as a rope, short strings are copied to one
+    const rope *asRope() const;
+
+    /// appends the characters of a string to out
+    void appendText(std::string &out) const;
 
-    atom evalRest(environment &env) const {
-        return atom(lv.rest(), env);
+    text_builder &asBuilder() const {
+        expect(BLD);
+        return *tb;
     }
 
-    atom evalEach(environment &env) const {
-        return atom(lv, env);
+    size_t size() const {
+        return asList().size();
     }
 
+    /// printed form, which the reader reads back for data
+    std::string repr() const;
+
+    atom eval(environment &env) const;
+
+    atom operator()(environment &env, const atom &values);
+
     atom front() const {
-        expect(LST);
-        return atom(lv.front());
+        return asList().front();
     }
 
     atom rest() const {
-        expect(LST);
-        return atom(lv.rest());
+        return atom(asList().rest());
     }
 
     atom length() const {
-        expect(LST);
-        return atom(lv.size());
+        return atom(static_cast<int64_t>(asList().size()));
     }
 
-    bool operator==(const atom &b) {
-        if (t != b.t)
-            return false;
-        switch (t) {
-        case NIL:
-            return true;
-        case INT:
-            return iv == b.iv;
-        case STR:
-            return sv == b.sv;
-        case LMB:
-        case LST:
-            // TODO!
-            return false;
-        case PRC:
-            // TODO!
-            return false;
-        }
-        return false;
+    /** structural equality. Lists and vectors are equal when their elements
+        are, numbers when they have the same type and value, functions and
+        futures only to themselves */
+    bool operator==(const atom &b) const;
+
+    bool operator!=(const atom &b) const {
+        return !(*this == b);
+    }
+
+    /// same value - the same number or symbol, or the very same object
+    bool identical(const atom &b) const {
+        return t == b.t && n == b.n && p == b.p;
     }
 
+    /// structural hash, consistent with operator==
+    struct hash {
+        size_t operator()(const atom &a) const;
+
+    private:
+        /// hash of a alone, adds the elements of lists and maps to pending
+        size_t shallow(const atom &a,
+                       std::vector<const atom *> &pending) const;
+    };
+
+    /// (args body) as written in the source
+    const atom &lambda_definition() const;
+
     const atom &lambda_args() const {
-        expect(LMB);
-        return lv[0];
+        return lambda_definition()[0];
     }
 
     const atom &lambda_body() const {
-        expect(LMB);
-        return lv[1];
+        return lambda_definition()[1];
     }
 
-    atom toLambda(const environment &env) const;
+    /// compiled body of a lambda
+    const code &lambda_code() const;
+
+    /// lambda template with compiled body, not yet bound to an environment
+    static atom lambda(code *c);
+
+    /// lambda template closed over the given frame and globals
+    atom bind(frame *outer, environment &globals) const;
 
 private:
+    friend class vm;
+    friend class heap;
+    friend class image;
+    friend int compareAtoms(const atom &a, const atom &b);
+
+    std::string textRepr() const;
+
+    /// compares a and b alone, adds pairs of their elements to pending
+    static bool equalShallow(const atom &a, const atom &b,
+                             std::vector<std::pair<const atom *,
+                                                   const atom *>> &pending);
+
+    /// string of a literal token, quotes included
+    static atom literal(const str_view &token);
+
+    /* 16 bytes, trivially copyable. Immediate values and pointers share
+       the payload, lists keep their offset into the block beside it.
+       Strings of up to short_text characters are kept in the payload with
+       their length + 1 in n, longer ones are ropes with n of 0 */
     atom_type t;
-    std::shared_ptr<environment> env;
+    uint32_t n;
     union {
-        int iv;
-        string sv;
-        list lv;
-        proc fv;
+        int64_t iv;
+        double dv;
+        const bignum *bg;
+        const packed *pv;
+        symbol sy;
+        list::block *lb;
+        const builtin *bi;
+        closure *cl;
+        task *tk;
+        memo *mm;
+        hash_map *hm;
+        const tree_node *tn;
+        const rope *st;
+        text_builder *tb;
+        char ch[short_text];
+        const void *p;
     };
 };
 
+static_assert(sizeof(atom) <= 16, "atom has to stay compact");
+static_assert(std::is_trivially_copyable<atom>::value,
+              "atoms are copied as plain bytes");
+
+const size_t atom::short_text;
+
 const atom atom::True("#t");
 const atom atom::False;
 const atom atom::Nil;
 
-list::list(const list &src) : car(src.car ? new atom(*src.car) : nullptr),
-                              cdr(src.cdr ? new list(*src.cdr) : nullptr)
-{}
+atom builtin::call(environment &env, const atom *args, size_t argc) const {
+    if (k == SPECIAL)
+        throw std::invalid_argument(
+                std::string("Special form ") + name + " is not a function");
+
+    if (argc < arity || (k == FIXED && argc != arity))
+        throw std::invalid_argument(
+                std::string("Wrong number of arguments to ") + name);
+
+    if (k == VARIADIC)
+        return fn.fv(env, args, argc);
+
+    switch (arity) {
+    case 0:
+        return fn.f0(env);
+    case 1:
+        return fn.f1(env, args[0]);
+    case 2:
+        return fn.f2(env, args[0], args[1]);
+    default:
+        return fn.f3(env, args[0], args[1], args[2]);
+    }
+}
+
+/* slots [lo, items.size()) are in use, the ones below lo are free for cons
+   to claim. Lists pointing into a block never start below lo, so claiming a
+   slot cannot change any of them. lo only moves down, by compare and swap,
+   as threads may cons onto the same list */
+struct list::block : object {
+    block() : lo(0), tail_size(0) {}
 
-list::list(const list &src, environment &env)
-    : car(src.car ? new atom(src.car->eval(env)) : nullptr),
-      cdr(src.cdr ? new list(*src.cdr, env) : nullptr)
-{}
+    void trace(heap &h) const;
+    size_t footprint() const;
 
-list &list::operator=(list &&a) {
-    std::swap(car, a.car);
-    std::swap(cdr, a.cdr);
-    a.clear();
-    return *this;
+    std::vector<atom, pool_allocator<atom>> items;
+    std::atomic<size_t> lo;
+    list tail;          ///< continues after the last item
+    size_t tail_size;   ///< length of tail, so size() is O(1)
+};
+
+size_t list::size() const {
+    if (!b)
+        return 0;
+    return b->items.size() - off + b->tail_size;
 }
 
 const atom &list::front() const {
-    if (car)
-        return *car;
+    if (b)
+        return b->items[off];
     return atom::Nil;
 }
 
-atom &list::front() {
-    return *car;
-}
+list list::rest() const {
+    if (!b)
+        return list();
 
-const atom &list::operator[](size_t idx) const {
-    if (idx == 0)
-        return front();
-    else {
-        if (cdr)
-            return (*cdr)[idx - 1];
-        else
-            return atom::Nil;
-    }
-}
+    if (off + 1 < b->items.size())
+        return list(b, off + 1);
 
-atom &list::operator[](size_t idx) {
-    if (idx == 0)
-        return front();
-    else {
-        if (cdr)
-            return (*cdr)[idx - 1];
-        else
-            throw std::out_of_range("List index out of range");
-    }
+    return b->tail;
 }
 
-void list::pop_front() {
-    if (cdr) {
-        car = std::move(cdr->car);
-        cdr = std::move(cdr->cdr);
-    } else {
-        car.reset(new atom(atom::Nil));
-        cdr.reset();
+const atom &list::operator[](size_t idx) const {
+    for (list l = *this; l.b; l = l.b->tail) {
+        size_t here = l.b->items.size() - l.off;
+        if (idx < here)
+            return l.b->items[l.off + idx];
+        idx -= here;
     }
+    return atom::Nil;
 }
 
-void list::push_back(const atom &a) {
-    if (car) {
-        if (cdr)
-            cdr->push_back(a);
-        else {
-            cdr.reset(new list());
-            cdr->push_back(a);
-        }
-    } else {
-        if (cdr)
-            throw std::runtime_error("CAR not null, CDR set!");
-
-        car.reset(new atom(a));
-    }
+const atom &list::const_iterator::operator*() {
+    assert(b);
+    return b->items[off];
 }
 
-void list::append(atom &&a) {
-    // TODO: append internal, so we won't check this every step
-    if (a.type() != atom::LST) {
-        push_back(a);
-        return;
-    }
-
-    if (car) {
-        if (cdr)
-            cdr->append(std::move(a));
-        else {
-            cdr.reset(new list());
-            *cdr = std::move(a.asList());
-            a.clear();
-        }
-    } else {
-        if (cdr)
-            throw std::runtime_error("CAR not null, CDR set!");
-
-        list mv = std::move(a.asList());
-        car = std::move(mv.car);
-        cdr = std::move(mv.cdr);
-        a.clear();
-    }
+const atom *list::const_iterator::operator->() {
+    assert(b);
+    return &b->items[off];
 }
 
-void list::push_back(atom &&a) {
-    if (car) {
-        if (cdr) {
-            cdr->push_back(a);
-        } else {
-            cdr.reset(new list());
-            cdr->push_back(std::move(a));
-            a.clear();
-        }
-    } else {
-        if (cdr)
-            throw std::runtime_error("CAR not null, CDR set!");
+list::const_iterator list::const_iterator::operator++() {
+    if (!b)
+        return *this;
 
-        car.reset(new atom(std::move(a)));
-        a.clear();
+    if (++off == b->items.size()) {
+        off = b->tail.off;
+        b = b->tail.b;
     }
+    return *this;
 }
 
 /** tokenizes input. Converts parts of string to literals, values,
@@ -712,17 +1479,15 @@ public:
     {}
 
     bool has_next() {
+        skip();
         return si != sv.end();
     }
 
     str_view next() {
+        skip();
         if (si == sv.end())
             return str_view();
 
-        // eat any spaces
-        while (si != sv.end() && ::isspace(*si))
-            ++si;
-
         str_view::const_iterator cur = si;
 
         // token will be the contents of the braces
@@ -732,337 +1497,5371 @@ public:
             return str_view(cur, si);
         }
 
+        // string literal, quotes included
+        if (*si == '"') {
+            skipString(si, sv.end());
+            return str_view(cur, si);
+        }
+
         // token - anything till next whitespace
-        while (si != sv.end() && !::isspace(*si) && *si != '(' && *si != ')')
+        while (si != sv.end() && !::isspace(*si) && *si != '(' && *si != ')'
+               && *si != '"')
             ++si;
 
         return str_view(cur, si);
     }
 
+    /** moves i from the opening quote of a string literal past its
+        closing one. Returns false if the literal ends with the input */
+    static bool skipString(str_view::const_iterator &i,
+                           str_view::const_iterator e) {
+        for (++i; i != e; ++i) {
+            if (*i == '"') {
+                ++i;
+                return true;
+            }
+            if (*i == '\\' && i + 1 != e)
+                ++i;
+        }
+        return false;
+    }
+
     str_view peek_next() {
         tokenizer cpy(*this);
         return cpy.next();
     }
 
-    str_view sv;
-    str_view::const_iterator si;
-};
+    /// eats spaces and comments running from ; to the end of line
+    void skip() {
+        while (si != sv.end()) {
+            if (*si == ';') {
+                while (si != sv.end() && *si != '\n')
+                    ++si;
+            } else if (::isspace(*si)) {
+                ++si;
+            } else {
+                break;
+            }
+        }
+    }
 
-struct environment {
-    typedef std::map<std::string, atom> map;
+    str_view sv;
+    str_view::const_iterator si;
+};
 
-    environment(std::shared_ptr<environment> parent)
-        : outer(parent)
-    {}
+/** mark and sweep garbage collector. Allocating never collects, collections
+    only happen at safepoints in the VM where every live value is reachable
+    from a registered root set - environments, the VM stacks with their
+    active calls and atoms pinned by gc_root.
+
+    Each thread links the objects it makes into a nursery of its own, which
+    joins the heap when a parallel task finishes, the thread exits or the
+    collector runs. Threads run interpreter code inside a heap::mutator
+    scope. A collection stops the world: the collecting thread waits until
+    every other thread in a scope parks at its next safepoint, collects and
+    then lets them go on. No collection happens while tasks are in flight */
+class heap {
+public:
+    // never destroyed - static objects may still refer to the heap at exit
+    static heap &instance() {
+        static heap *h = new heap();
+        return *h;
+    }
 
-    environment()
-        : outer()
-    {}
+    /** marks the calling thread as running interpreter code for its
+        lifetime. Objects may only be made and used inside such a scope,
+        scopes nest */
+    class mutator {
+    public:
+        mutator() {
+            heap::instance().attach();
+        }
 
-    atom eval(const atom &src) {
-        return src.eval(*this);
+        ~mutator() {
+            heap::instance().detach();
+        }
+
+        mutator(const mutator &) = delete;
+        mutator &operator=(const mutator &) = delete;
+    };
+
+    template <class T, class... Args>
+    T *make(Args &&...args) {
+        T *o = new T(std::forward<Args>(args)...);
+        nursery &n = local();
+        o->next = n.objects;
+        n.objects = o;
+        if (!n.last)
+            n.last = o;
+        ++n.count;
+        n.allocated += sizeof(T);
+        return o;
     }
 
-    atom &operator[](const std::string &key) {
-        map::iterator i = values.find(key);
-        if (i != values.end())
-            return i->second;
+    /// records memory an object acquired after it was made
+    void account(size_t bytes) {
+        local().allocated += bytes;
+    }
 
-        if (outer)
-            return (*outer)[key];
+    void add_root(const root_set *r) {
+        std::lock_guard<std::mutex> guard(lock);
+        roots.push_back(r);
+    }
 
-        throw std::invalid_argument("No symbol with name " + key);
+    /// w is pruned by every collection until the process exits
+    void add_weak(weak_set *w) {
+        std::lock_guard<std::mutex> guard(lock);
+        weak.push_back(w);
     }
 
-    const atom &operator[](const std::string &key) const {
-        map::const_iterator i = values.find(key);
-        if (i != values.end())
-            return i->second;
+    void remove_root(const root_set *r) {
+        std::lock_guard<std::mutex> guard(lock);
+        // roots mostly come and go in stack order
+        for (size_t i = roots.size(); i; --i) {
+            if (roots[i - 1] == r) {
+                roots.erase(roots.begin() + (i - 1));
+                return;
+            }
+        }
+    }
+
+    /** parks while another thread collects, otherwise collects once the
+        heap doubled since the last collection */
+    void safepoint() {
+        if (stopping.load(std::memory_order_acquire))
+            park();
+        else if (!parallel() && bytes() >= threshold.load(relaxed))
+            collect();
+    }
 
-        if (outer)
-            return (*outer)[key];
+    /** stops the other threads running interpreter code and collects. Does
+        nothing while parallel tasks are in flight */
+    void collect() {
+        size_t self = local_state().depth ? 1 : 0;
+        std::unique_lock<std::mutex> guard(lock);
 
-        throw std::invalid_argument("No symbol with name " + key);
+        // someone else got there first, their collection does for ours
+        if (stopping.load(relaxed)) {
+            wait(guard, self);
+            return;
+        }
+        if (parallel())
+            return;
+
+        stopping.store(true, std::memory_order_release);
+        stopped.wait(guard, [&] {
+            return parked + self == running || parallel();
+        });
+        if (!parallel())
+            sweep();
+        stopping.store(false, std::memory_order_release);
+        resumed.notify_all();
     }
 
-    atom &set(const std::string &key) {
-        map::iterator i = values.find(key);
-        if (i != values.end())
-            return i->second;
+    void mark(const object *o) {
+        if (o && !o->marked) {
+            o->marked = true;
+            gray.push_back(o);
+        }
+    }
 
-        if (outer) {
-            i = outer->values.find(key);
-            if (i != outer->values.end())
-                return i->second;
+    void mark(const atom &a);
+
+    /// whether a survives the collection in progress, see weak_set
+    bool marked(const atom &a) const;
+
+    /// number of objects currently allocated
+    size_t size() const {
+        return count.load(relaxed) + local().count;
+    }
+
+    /// approximate bytes currently allocated
+    size_t bytes() const {
+        return allocated.load(relaxed) + local().allocated;
+    }
+
+    /// running totals since the process started
+    struct totals {
+        size_t objects;
+        size_t bytes;
+        size_t collections;
+    };
+
+    /** objects made, bytes allocated and collections run so far. What other
+        threads made is counted once their nurseries join the heap */
+    totals made() const {
+        std::lock_guard<std::mutex> guard(lock);
+        const nursery &n = local();
+        return totals{made_objects + n.count, made_bytes + n.allocated,
+                      collections};
+    }
+
+    /// a task is handed to another thread
+    void begin_task() {
+        std::lock_guard<std::mutex> guard(lock);
+        tasks.fetch_add(1, std::memory_order_acq_rel);
+        // a collector waiting for this thread to park gives up
+        stopped.notify_all();
+    }
+
+    /// the calling thread finished a task, its objects join the heap
+    void end_task() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            adopt(local());
         }
+        tasks.fetch_sub(1, std::memory_order_acq_rel);
+    }
 
-        // create new entry
-        return values[key];
+    /** whether tasks may be running on other threads. Without any, threads
+        running interpreter code only share what their instances share */
+    bool parallel() const {
+        return tasks.load(std::memory_order_acquire) != 0;
     }
 
-    map values;
-    std::shared_ptr<environment> outer;
-};
+private:
+    static const size_t min_threshold = 8 * 1024 * 1024;
+    static const std::memory_order relaxed = std::memory_order_relaxed;
+
+    /// objects made by one thread and not yet linked into the heap
+    struct nursery {
+        object *objects;
+        object *last;
+        size_t count;
+        size_t allocated;
+    };
 
-std::shared_ptr<environment> clone_environment(
-        const std::shared_ptr<environment> &env)
-{
-    if (env)
-        return std::make_shared<environment>(*env);
-    else
-        return std::shared_ptr<environment>();
-}
+    /// what the heap keeps for each thread, registered while it lives
+    struct thread_state {
+        thread_state() : n(), depth(0) {
+            heap &h = instance();
+            std::lock_guard<std::mutex> guard(h.lock);
+            h.nurseries.push_back(&n);
+        }
 
-atom atom::eval(environment &env) const {
-    switch (t) {
-    case NIL:
-        return *this;
-    case INT:
-        return *this;
-    case STR:
-        return env[sv];
-    case LMB:
-    {
-        return lambda_body().eval(env);
+        ~thread_state() {
+            heap &h = instance();
+            std::lock_guard<std::mutex> guard(h.lock);
+            h.adopt(n);
+            h.nurseries.erase(
+                std::find(h.nurseries.begin(), h.nurseries.end(), &n));
+        }
+
+        nursery n;
+        size_t depth;   ///< nesting of mutator scopes
+    };
+
+    heap()
+        : objects(nullptr), count(0), allocated(0), threshold(min_threshold),
+          made_objects(0), made_bytes(0), collections(0), tasks(0),
+          stopping(false), running(0), parked(0)
+    {}
+
+    static thread_state &local_state() {
+        static thread_local thread_state s;
+        return s;
     }
-    case LST: {
-        // empty list evaluates to itself
-        if (lv.empty())
-            return *this;
-
-        atom result = env[lv.begin()->asString()](env, rest());
-#ifdef LISPY_DEBUG
-        // evaluate by finding proc for first element
-        std::cout << "Eval  "   << repr()
-                  << " with "   << lv.begin()->asString()
-                  << " args "   << rest().repr()
-                  << " via "    << env[lv.begin()->asString()].repr()
-                  << " yields " << result.repr()
-                  << std::endl;
-#endif
-        return result;
+
+    static nursery &local() {
+        return local_state().n;
     }
-    case PRC:
-        return fv(env, evalRest(env));
+
+    void attach() {
+        if (local_state().depth++)
+            return;
+        std::unique_lock<std::mutex> guard(lock);
+        resumed.wait(guard, [this] { return !stopping.load(relaxed); });
+        ++running;
     }
-    return Nil;
-}
 
-atom atom::operator()(environment &current_env, const atom &values) {
-    if (t == PRC)
-        return fv(current_env, values);
-    else if (t == LMB) {
-        if (!env)
-            throw std::invalid_argument(
-                    "Lambda is missing environment");
+    void detach() {
+        if (--local_state().depth)
+            return;
+        std::lock_guard<std::mutex> guard(lock);
+        --running;
+        // the collector may be waiting for this thread alone
+        stopped.notify_all();
+    }
+
+    void park() {
+        std::unique_lock<std::mutex> guard(lock);
+        wait(guard, 1);
+    }
+
+    /// waits for the collection in progress, counted as parked if self
+    void wait(std::unique_lock<std::mutex> &guard, size_t self) {
+        if (!stopping.load(relaxed))
+            return;
+        parked += self;
+        stopped.notify_all();
+        resumed.wait(guard, [this] { return !stopping.load(relaxed); });
+        parked -= self;
+    }
+
+    /// the world is stopped, marks from the roots and frees the rest
+    void sweep() {
+        for (nursery *n : nurseries)
+            adopt(*n);
 
-        // iterate lambda_args, fill all with values
-        list::const_iterator vit = values.asList().begin();
-        for (const auto &larg : lambda_args().asList()) {
-            if (vit == values.asList().end()) {
-                throw std::invalid_argument(
-                        "Lambda call with incomplete arguments");
+        for (const root_set *r : roots)
+            r->trace(*this);
+
+        // an explicit stack instead of recursion, lists can be long
+        while (!gray.empty()) {
+            const object *o = gray.back();
+            gray.pop_back();
+            o->trace(*this);
+        }
+
+        for (weak_set *w : weak)
+            w->prune(*this);
+
+        size_t live = 0;
+        size_t kept = 0;
+        object **link = &objects;
+        while (object *o = *link) {
+            if (o->marked) {
+                o->marked = false;
+                link = &o->next;
+                live += o->footprint();
+                ++kept;
+            } else {
+                *link = o->next;
+                delete o;
             }
+        }
 
-            env->set(larg.asString()) = *vit++;
+        count.store(kept, relaxed);
+        allocated.store(live, relaxed);
+        threshold.store(std::max(min_threshold, live * 2), relaxed);
+        ++collections;
+    }
+
+    void adopt(nursery &n) {
+        if (n.objects) {
+            n.last->next = objects;
+            objects = n.objects;
         }
+        count.fetch_add(n.count, relaxed);
+        allocated.fetch_add(n.allocated, relaxed);
+        made_objects += n.count;
+        made_bytes += n.allocated;
+        n = nursery();
+    }
+
+    object *objects;
+    // read by safepoints and size() without the lock
+    std::atomic<size_t> count;
+    std::atomic<size_t> allocated;
+    std::atomic<size_t> threshold;
+    size_t made_objects;
+    size_t made_bytes;
+    size_t collections;
+    std::atomic<size_t> tasks;
+    std::atomic<bool> stopping;     ///< a collection waits for threads to park
+    size_t running;                 ///< threads inside a mutator scope
+    size_t parked;                  ///< of those, the ones waiting at one
+    mutable std::mutex lock;
+    std::condition_variable stopped;    ///< a thread parked or left
+    std::condition_variable resumed;    ///< the collection finished
+    std::vector<nursery *> nurseries;
+    std::vector<const root_set *> roots;
+    std::vector<weak_set *> weak;
+    std::vector<const object *> gray;
+};
+
+const size_t heap::min_threshold;
 
-        return lambda_body().eval(*env);
+/// keeps an atom held by C++ code alive while it calls back into the VM
+class gc_root : public root_set {
+public:
+    explicit gc_root(const atom &a) : a(a) {
+        heap::instance().add_root(this);
     }
 
-    throw std::invalid_argument(
-            "Could not eval");
-}
+    ~gc_root() {
+        heap::instance().remove_root(this);
+    }
 
-atom atom::toLambda(const environment &env) const {
-    expect(LST);
-    if (lv.size() != 2)
-        throw std::invalid_argument(
-                "Lambda definition needs two list params");
+    void trace(heap &h) const {
+        h.mark(a);
+    }
 
-    if (lv[0].t != LST)
-        throw std::invalid_argument(
-                "Lambda definition's first arg has to be list of args");
+private:
+    const atom &a;
+};
 
-    if (lv[1].t != LST)
-        throw std::invalid_argument(
-                "Lambda definition's second arg has to be the body");
+/** read/write lock over the bindings of all environments. It is only taken
+    while parallel tasks are in flight, single threaded evaluation never
+    touches it */
+class binding_guard {
+public:
+    explicit binding_guard(bool exclusive)
+        : held(heap::instance().parallel())
+    {
+        if (held && exclusive)
+            ::pthread_rwlock_wrlock(&lock());
+        else if (held)
+            ::pthread_rwlock_rdlock(&lock());
+    }
 
-    // special conversion here
-    atom cpy(*this);
-    cpy.t = LMB;
-    cpy.env.reset(new environment(env));
-    return cpy;
-}
+    ~binding_guard() {
+        if (held)
+            ::pthread_rwlock_unlock(&lock());
+    }
 
+    binding_guard(const binding_guard &) = delete;
+    binding_guard &operator=(const binding_guard &) = delete;
 
-void bind_std(environment &env) {
-    env.set("nil") = atom::Nil;
-    env.set("#t") = atom::True;
-    env.set("#f") = atom::False;
-    env.set("if") = [](environment &env, const atom &params) {
-        return params[0].eval(env) == atom::False ?
-        (params[2].eval(env)) :
-        (params[1].eval(env));
-    };
+private:
+    static pthread_rwlock_t &lock() {
+        static pthread_rwlock_t l = PTHREAD_RWLOCK_INITIALIZER;
+        return l;
+    }
 
-    // TODO: These should respect the environment of the atom in question
-    env.set("set!") = [](environment &env, const atom &params) {
-        return env.set(params[0].asString()) = params[1].eval(env);
-    };
+    bool held;
+};
 
-    env.set("setq") = [](environment &env, const atom &params) {
-        return env.set(params[0].asString()) = params[1];
-    };
+/** refers lambdas and tasks to the environment they were made in. It stays
+    behind when the environment is destroyed, so that calling them fails
+    instead of reaching a dangling pointer */
+struct env_link : object {
+    explicit env_link(environment *env) : env(env) {}
 
-    env.set("lambda") = [](environment &env, const atom &params) {
-        return params.toLambda(env);
-    };
+    void trace(heap &) const {}
 
-    env.set("define") = [](environment &env, const atom &params) {
-        return env.set(params[0].asString()) = params[1].eval(env);
-    };
+    size_t footprint() const {
+        return sizeof(*this);
+    }
 
-    env.set("env") = [](environment &env, const atom &) {
-        atom aenv(atom::LST);
-        for (const auto &kv : env.values) {
-            atom val(atom::LST);
-            val.push_back(atom(kv.first));
-            val.push_back(kv.second);
-            aenv.push_back(val);
-        }
-        return aenv;
-    };
+    environment *env;   ///< null once the environment is gone
+};
 
-    env.set("quote") = [](environment &env, const atom &v) {
-        return v[0];
-    };
+/** global bindings. Every environment is a root of the garbage collector
+    for as long as it exists. The VM goes through get() and define(), which
+    are safe to use from parallel tasks.
 
-    env.set("list") = [](environment &env, const atom &v) {
-        return v.evalEach(env);
-    };
+    A frozen environment never changes again, so it can be the parent of
+    any number of environments without being copied and is read without
+    locking. Definitions in a child shadow the frozen bindings instead of
+    changing them.
 
-    env.set("length") = [](environment &env, const atom &v) {
-        return v[0].eval(env).length();
-    };
+    Lambdas and futures made in an environment may outlive it, calling
+    them afterwards is an error. Tasks still running in it have to be
+    touched before it is destroyed */
+struct environment : root_set {
+    typedef std::unordered_map<symbol, atom, symbol::hash> map;
 
-    env.set("eval") = [](environment &env, const atom &v) {
-        return v[0].eval(env).eval(env);
-    };
+    environment(std::shared_ptr<environment> parent)
+        : outer(parent), frozen(false), self(makeLink())
+    {
+        heap::instance().add_root(this);
+    }
 
-    env.set("append") = [](environment &env, const atom &v) {
-        atom ev = v[0].eval(env);
-        atom lst = ev[0];
-        lst.asList().append(lst.rest());
-        return lst;
-    };
+    environment() : outer(), frozen(false), self(makeLink()) {
+        heap::instance().add_root(this);
+    }
 
-    env.set("car") = [](environment &env, const atom &v) {
-        return v[0].eval(env).front();
-    };
+    // copies are never frozen, and lambdas made in other stay with other
+    environment(const environment &other)
+        : values(other.values), outer(other.outer), frozen(false),
+          self(makeLink())
+    {
+        heap::instance().add_root(this);
+    }
 
-    env.set("cdr") = [](environment &env, const atom &v) {
-        return v[0].eval(env).rest();
-    };
+    ~environment() {
+        // self stays reachable until the root goes
+        self->env = nullptr;
+        heap::instance().remove_root(this);
+    }
 
-    env.set("*") = [](environment &env, const atom &v) {
-        int res = 1;
-        for (const atom &a : v.asList()) {
-            res *= a.eval(env).asInt();
-        }
-        return atom(res);
-    };
+    void trace(heap &h) const {
+        h.mark(self);
+        for (const auto &kv : values)
+            h.mark(kv.second);
+    }
+
+    /// what lambdas and tasks made in this environment refer to it by
+    env_link *link() const {
+        return self;
+    }
+
+    atom eval(const atom &src) {
+        return src.eval(*this);
+    }
 
-    env.set("+") = [](environment &env, const atom &v) {
-        int res = 0;
-        for (const atom &a : v.asList()) {
-            res += a.eval(env).asInt();
+    atom &operator[](const symbol &key) {
+        for (environment *e = this; e; e = e->outer.get()) {
+            map::iterator i = e->values.find(key);
+            if (i != e->values.end())
+                return i->second;
         }
-        return atom(res);
-    };
 
-    env.set("-") = [](environment &env, const atom &v) {
-        const list &lst = v.asList();
-        int res = lst.front().eval(env).asInt();
-        for (const atom &a : lst.rest()) {
-            res -= a.eval(env).asInt();
+        throw std::invalid_argument("No symbol with name " + key.name());
+    }
+
+    const atom &operator[](const symbol &key) const {
+        for (const environment *e = this; e; e = e->outer.get()) {
+            map::const_iterator i = e->values.find(key);
+            if (i != e->values.end())
+                return i->second;
         }
-        return atom(res);
-    };
 
-    env.set("/") = [](environment &env, const atom &v) {
-        const list &lst = v.asList();
-        int res = lst.front().eval(env).asInt();
-        for (const atom &a : lst.rest()) {
-            res /= a.eval(env).asInt();
+        throw std::invalid_argument("No symbol with name " + key.name());
+    }
+
+    atom &operator[](const std::string &key) {
+        return (*this)[symbol(key)];
+    }
+
+    /// value bound to key here or in an outer environment
+    atom get(const symbol &key) const {
+        const environment *e = this;
+        {
+            binding_guard guard(false);
+            for (; e && !e->frozen; e = e->outer.get()) {
+                map::const_iterator i = e->values.find(key);
+                if (i != e->values.end())
+                    return i->second;
+            }
         }
-        return atom(res);
-    };
 
-    env.set("<") = [](environment &env, const atom &v) {
-        const list &lst = v.asList();
-        int res = lst.front().eval(env).asInt();
-        for (const atom &a : lst.rest()) {
-            if (res > a.eval(env).asInt())
-                return atom::False;
+        // frozen environments and their parents never change
+        for (; e; e = e->outer.get()) {
+            map::const_iterator i = e->values.find(key);
+            if (i != e->values.end())
+                return i->second;
         }
-        return atom::True;
-    };
 
-    env.set(">") = [](environment &env, const atom &v) {
-        const list &lst = v.asList();
-        int res = lst.front().eval(env).asInt();
-        for (const atom &a : lst.rest()) {
-            if (res < a.eval(env).asInt())
-                return atom::False;
+        throw std::invalid_argument("No symbol with name " + key.name());
+    }
+
+    /// binds key to value, see set()
+    void define(const symbol &key, const atom &value) {
+        binding_guard guard(true);
+        set(key) = value;
+    }
+
+    atom &set(const symbol &key) {
+        if (frozen)
+            throw std::invalid_argument("Cannot bind " + key.name()
+                                        + " in a frozen environment");
+
+        map::iterator i = values.find(key);
+        if (i != values.end())
+            return i->second;
+
+        if (outer && !outer->frozen) {
+            i = outer->values.find(key);
+            if (i != outer->values.end())
+                return i->second;
         }
-        return atom::True;
-    };
 
-}
+        // create new entry
+        return values[key];
+    }
 
-atom build_from(tokenizer &t) {
-    // nill
-    if (!t.has_next())
-        return atom();
+    atom &set(const std::string &key) {
+        return set(symbol(key));
+    }
 
-    // peek first token
-    str_view tok = t.next();
+    /** makes this environment and all its parents immutable. Has to happen
+        before the environment is shared with other threads */
+    void freeze() {
+        for (environment *e = this; e; e = e->outer.get())
+            e->frozen = true;
+    }
 
-    if (tok == "(") {
-        atom a(atom::LST);
+    bool isFrozen() const {
+        return frozen;
+    }
 
-        while (t.has_next()) {
-            tok = t.peek_next();
+    map values;
+    std::shared_ptr<environment> outer;
 
-            if (tok == ")") {
-                t.next();
-                break;
-            }
+private:
+    // the link may be the first object the calling thread makes
+    env_link *makeLink() {
+        heap::mutator running;
+        return heap::instance().make<env_link>(this);
+    }
 
-            atom inner = build_from(t);
-            a.asList().push_back(inner);
-        }
+    bool frozen;
+    env_link *self;
+};
 
-        return a;
-    } else {
-        return atom(tok);
+/** variables of a lambda. The compiler resolves every local variable to a
+    (depth, slot) pair, so access is a walk of depth outer links followed by
+    an index into the flat slot array */
+struct frame : object {
+    frame(size_t slots, frame *outer)
+        : slots(slots), outer(outer)
+    {}
+
+    atom &at(size_t depth, size_t slot) {
+        frame *f = this;
+        for (; depth; --depth)
+            f = f->outer;
+        return f->slots[slot];
     }
-}
 
-atom exec(environment &env, const std::string &expr) {
-    str_view sv(expr);
+    void trace(heap &h) const {
+        for (const atom &a : slots)
+            h.mark(a);
+        h.mark(outer);
+    }
 
-    tokenizer t(sv);
+    size_t footprint() const {
+        return sizeof(*this) + slots.capacity() * sizeof(atom);
+    }
 
-    atom result;
+    std::vector<atom, pool_allocator<atom>> slots;
+    frame *outer;
+};
 
-    while (t.has_next()) {
-        atom parsed = build_from(t);
-        result = env.eval(parsed);
+/// bytecode instruction set
+enum opcode : uint8_t {
+    OP_CONST,          ///< push consts[arg]
+    OP_GLOBAL,         ///< push global bound to names[arg]
+    OP_SET_GLOBAL,     ///< bind global names[arg] to top of stack, keep it
+    OP_LOCAL,          ///< push local variable, arg is (depth << 16 | slot)
+    OP_SET_LOCAL,      ///< store top of stack to local variable, keep it
+    OP_POP,            ///< drop top of stack
+    OP_JUMP,           ///< continue at instruction arg
+    OP_JUMP_IF_FALSE,  ///< pop, continue at instruction arg if it was false
+    OP_LAMBDA,         ///< push closure of lambda template consts[arg]
+    OP_CALL,           ///< call function below arg arguments, push result
+    OP_TAIL_CALL,      ///< call replacing the current one, for tail position
+    OP_RETURN          ///< return top of stack
+};
+
+struct instr {
+    instr(opcode op, uint32_t arg = 0) : op(op), arg(arg) {}
+
+    opcode op;
+    uint32_t arg;
+};
+
+/// compiled form or lambda body
+struct code : object {
+    void trace(heap &h) const {
+        for (const atom &a : consts)
+            h.mark(a);
+        h.mark(definition);
     }
 
-    return result;
+    size_t footprint() const {
+        return sizeof(*this) + ops.capacity() * sizeof(instr)
+                + consts.capacity() * sizeof(atom);
+    }
+
+    std::vector<instr> ops;
+    std::vector<atom> consts;
+    std::vector<symbol> names;
+    std::vector<symbol> params;
+    size_t slots = 0;  ///< frame size, params first then local defines
+    bool captures = false;  ///< creates closures over its frame
+    atom definition;   ///< (args body) of a lambda
+    symbol name;       ///< of a lambda bound by define, for the profiler
+};
+
+/** lambda bound to the frame it was created in, which becomes the outer
+    frame of every call. Closures are immutable and shared by all copies of
+    the lambda. Templates kept in the constants of compiled code are not
+    bound to any environment yet */
+struct closure : object {
+    closure(code *body, frame *outer, env_link *env)
+        : body(body), outer(outer), env(env)
+    {}
+
+    void trace(heap &h) const {
+        h.mark(body);
+        h.mark(outer);
+        h.mark(env);
+    }
+
+    size_t footprint() const {
+        return sizeof(*this);
+    }
+
+    code *body;
+    frame *outer;
+    env_link *env;      ///< where the lambda was made, null if unbound
+};
+
+/** garbage collected bigint, the payload of BIG atoms. Immutable, and only
+    ever holds values outside the range of int64_t */
+struct bignum : object {
+    explicit bignum(bigint &&v) : v(std::move(v)) {}
+
+    void trace(heap &) const {}
+
+    size_t footprint() const {
+        return sizeof(*this) + v.mag.capacity() * sizeof(uint32_t);
+    }
+
+    const bigint v;
+};
+
+/** packed vector of int64_t or double, the payload of VEC atoms. Elements
+    are stored contiguously for the SIMD kernels, vectors are immutable once
+    built */
+struct packed : object {
+    packed(bool real, size_t n)
+        : real(real), ints(real ? 0 : n), reals(real ? n : 0)
+    {}
+
+    size_t size() const {
+        return real ? reals.size() : ints.size();
+    }
+
+    atom at(size_t i) const {
+        return real ? atom(reals[i]) : atom(ints[i]);
+    }
+
+    void trace(heap &) const {}
+
+    size_t footprint() const {
+        return sizeof(*this) + ints.capacity() * sizeof(int64_t)
+                + reals.capacity() * sizeof(double);
+    }
+
+    const bool real;
+    std::vector<int64_t> ints;
+    std::vector<double> reals;
+};
+
+/** immutable string too long to be kept in an atom, the payload of STR
+    atoms. A flat rope holds characters, either its own or a part of those
+    of another flat rope. A concatenation holds its two halves, so joining
+    strings never copies them; the characters are gathered once, the first
+    time they are needed in one piece */
+struct rope : object {
+    explicit rope(std::string &&s)
+        : chars(nullptr), size(s.size()), left(nullptr), right(nullptr),
+          own(std::move(s)), flat_copy(nullptr)
+    {
+        chars = own.data();
+    }
+
+    /// n characters of the flat rope base starting at from
+    rope(const rope *base, size_t from, size_t n)
+        : chars(base->chars + from), size(n), left(base->owner()),
+          right(nullptr), flat_copy(nullptr)
+    {}
+
+    rope(const rope *left, const rope *right)
+        : chars(nullptr), size(left->size + right->size), left(left),
+          right(right), flat_copy(nullptr)
+    {}
+
+    bool flat() const {
+        return chars != nullptr;
+    }
+
+    /// flat rope with the same characters, made once and kept
+    const rope *flatten() const {
+        if (flat())
+            return this;
+
+        const rope *f = flat_copy.load(std::memory_order_acquire);
+        if (f)
+            return f;
+
+        std::string s;
+        s.reserve(size);
+        appendTo(s);
+        rope *made = heap::instance().make<rope>(std::move(s));
+        heap::instance().account(made->own.capacity());
+
+        // another thread may have been faster, its copy is as good
+        if (flat_copy.compare_exchange_strong(f, made,
+                                              std::memory_order_acq_rel))
+            return made;
+        return f;
+    }
+
+    /// appends the characters to out, without recursion for deep ropes
+    void appendTo(std::string &out) const {
+        std::vector<const rope *> todo(1, this);
+        while (!todo.empty()) {
+            const rope *r = todo.back();
+            todo.pop_back();
+            if (const rope *f = r->flat() ? r : r->flat_copy.load(
+                        std::memory_order_acquire)) {
+                out.append(f->chars, f->size);
+            } else {
+                todo.push_back(r->right);
+                todo.push_back(r->left);
+            }
+        }
+    }
+
+    void trace(heap &h) const {
+        h.mark(left);
+        h.mark(right);
+        h.mark(flat_copy.load(std::memory_order_acquire));
+    }
+
+    size_t footprint() const {
+        return sizeof(*this) + own.capacity();
+    }
+
+    const char *chars;          ///< of flat ropes, null for concatenations
+    const size_t size;
+    const rope *const left;     ///< first half, or whose characters these are
+    const rope *const right;
+
+private:
+    /// rope whose characters a flat rope refers to
+    const rope *owner() const {
+        return left ? left : this;
+    }
+
+    std::string own;
+    mutable std::atomic<const rope *> flat_copy;
+};
+
+/** mutable buffer strings are accumulated in, the payload of BLD atoms.
+    Appending is amortized constant time per character */
+struct text_builder : object {
+    void append(const atom &a);
+
+    std::string str() const {
+        std::lock_guard<std::mutex> guard(lock);
+        return buf;
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> guard(lock);
+        return buf.size();
+    }
+
+    void trace(heap &) const {}
+
+    size_t footprint() const {
+        return sizeof(*this) + buf.capacity();
+    }
+
+private:
+    std::string buf;
+    mutable std::mutex lock;
+};
+
+atom atom::text(const str_view &s) {
+    atom a(STR);
+    if (s.size() <= short_text) {
+        a.n = s.size() + 1;
+        std::copy(s.begin(), s.end(), a.ch);
+        return a;
+    }
+
+    rope *r = heap::instance().make<rope>(s.str());
+    heap::instance().account(r->footprint() - sizeof(*r));
+    a.st = r;
+    return a;
+}
+
+atom atom::text(const rope *r) {
+    if (r->size <= short_text) {
+        std::string s;
+        r->appendTo(s);
+        return text(str_view(s));
+    }
+
+    atom a(STR);
+    a.st = r;
+    return a;
+}
+
+size_t atom::textSize() const {
+    expect(STR);
+    return n ? n - 1 : st->size;
+}
+
+str_view atom::asText() const {
+    expect(STR);
+    if (n)
+        return str_view(ch, ch + n - 1);
+    const rope *f = st->flatten();
+    return str_view(f->chars, f->chars + f->size);
+}
+
+const rope *atom::asRope() const {
+    expect(STR);
+    if (n)
+        return heap::instance().make<rope>(std::string(ch, n - 1));
+    return st;
+}
+
+void atom::appendText(std::string &out) const {
+    expect(STR);
+    if (n)
+        out.append(ch, n - 1);
+    else
+        st->appendTo(out);
+}
+
+std::string atom::textRepr() const {
+    std::string result = "\"";
+    for (char c : asText()) {
+        switch (c) {
+        case '"': result += "\\\""; break;
+        case '\\': result += "\\\\"; break;
+        case '\n': result += "\\n"; break;
+        case '\t': result += "\\t"; break;
+        default: result += c; break;
+        }
+    }
+    return result + "\"";
+}
+
+atom atom::literal(const str_view &token) {
+    str_view::const_iterator i = token.begin() + 1, e = token.end();
+    if (token.size() < 2 || *(e - 1) != '"')
+        throw std::invalid_argument("Unterminated string " + token.str());
+    --e;
+
+    if (std::find(i, e, '\\') == e)
+        return text(str_view(i, e));
+
+    std::string s;
+    for (; i != e; ++i) {
+        if (*i != '\\' || i + 1 == e) {
+            s += *i;
+            continue;
+        }
+        switch (*++i) {
+        case 'n': s += '\n'; break;
+        case 't': s += '\t'; break;
+        default: s += *i; break;
+        }
+    }
+    return text(str_view(s));
+}
+
+/** joins two strings. Short results are copied, longer ones share both
+    halves. A short piece appended to a concatenation ending in a short
+    flat rope is merged into that one, so strings built by appending small
+    fragments do not end up with a node per fragment */
+atom concatText(const atom &a, const atom &b) {
+    static const size_t merged = 64;
+
+    size_t na = a.textSize(), nb = b.textSize();
+    if (!nb)
+        return a;
+    if (!na)
+        return b;
+
+    heap &h = heap::instance();
+    if (na + nb <= merged) {
+        std::string s;
+        s.reserve(na + nb);
+        a.appendText(s);
+        b.appendText(s);
+        return atom::text(str_view(s));
+    }
+
+    const rope *l = a.asRope();
+    if (nb < merged && !l->flat() && l->right->flat()
+        && l->right->size + nb <= merged) {
+        std::string s(l->right->chars, l->right->size);
+        b.appendText(s);
+        const rope *tail = h.make<rope>(std::move(s));
+        return atom::text(h.make<rope>(l->left, tail));
+    }
+    return atom::text(h.make<rope>(l, b.asRope()));
+}
+
+/// characters [from, to) of a string, sharing them with s when long
+atom substring(const atom &s, size_t from, size_t to) {
+    if (from > to || to > s.textSize())
+        throw std::invalid_argument("Substring out of range");
+
+    str_view all = s.asText();
+    if (to - from <= atom::short_text)
+        return atom::text(all.part(all.begin() + from, all.begin() + to));
+
+    const rope *f = s.asRope()->flatten();
+    return atom::text(heap::instance().make<rope>(f, from, to - from));
+}
+
+/// characters of a string or the name of a symbol
+std::string textOf(const atom &a) {
+    if (a.type() == atom::SYM)
+        return a.asSymbol().name();
+    return a.asText().str();
+}
+
+/// strings are appended as they are, anything else as printed
+void text_builder::append(const atom &a) {
+    std::lock_guard<std::mutex> guard(lock);
+    size_t capacity = buf.capacity();
+    if (a.type() == atom::STR)
+        a.appendText(buf);
+    else
+        buf += a.repr();
+    if (buf.capacity() > capacity)
+        heap::instance().account(buf.capacity() - capacity);
+}
+
+/** unit of work for the scheduler, the payload of FUT atoms. Calls fn with
+    args, maps fn over args or folds args with fn, then keeps the result or
+    the error until the task is touched */
+struct task : object {
+    enum kind {
+        CALL,
+        MAP,
+        REDUCE
+    };
+
+    task(kind k, const atom &fn, environment &env)
+        : k(k), fn(fn), env(env.link()), failed(false), done(false)
+    {}
+
+    /// runs the task on the calling thread, see scheduler
+    void run();
+
+    void trace(heap &h) const {
+        h.mark(fn);
+        for (const atom &a : args)
+            h.mark(a);
+        h.mark(result);
+        h.mark(env);
+    }
+
+    size_t footprint() const {
+        return sizeof(*this) + args.capacity() * sizeof(atom);
+    }
+
+    const kind k;
+    atom fn;
+    std::vector<atom> args;
+    env_link *env;
+    atom result;
+    std::string error;
+    bool failed;
+    std::atomic<bool> done;
+};
+
+/** function with a bounded cache of its results keyed on the arguments,
+    the payload of MEM atoms. Arguments are compared structurally, so the
+    function has to be pure. Once the cache is full the least recently used
+    result is dropped */
+struct memo : object {
+    memo(const atom &fn, size_t capacity)
+        : fn(fn), capacity(std::max<size_t>(capacity, 1)), head(none),
+          tail(none)
+    {}
+
+    /// stores the result for args to value, false when there is none
+    bool find(const atom *args, size_t n, atom &value) {
+        std::lock_guard<std::mutex> guard(lock);
+        uint32_t i = lookup(args, n, hashArgs(args, n));
+        if (i == none)
+            return false;
+
+        unlink(i);
+        pushFront(i);
+        value = entries[i].value;
+        return true;
+    }
+
+    void insert(const atom *args, size_t n, const atom &value) {
+        std::lock_guard<std::mutex> guard(lock);
+        size_t h = hashArgs(args, n);
+        if (lookup(args, n, h) != none)
+            return;
+
+        uint32_t i;
+        if (entries.size() < capacity) {
+            i = entries.size();
+            entries.push_back(entry());
+            heap::instance().account(sizeof(entry) + n * sizeof(atom));
+        } else {
+            // reuse the least recently used entry
+            i = tail;
+            unlink(i);
+            drop(i);
+        }
+
+        entry &e = entries[i];
+        e.args.assign(args, args + n);
+        e.value = value;
+        e.hash = h;
+        index.insert(std::make_pair(h, i));
+        pushFront(i);
+    }
+
+    void trace(heap &h) const {
+        h.mark(fn);
+        for (const entry &e : entries) {
+            for (const atom &a : e.args)
+                h.mark(a);
+            h.mark(e.value);
+        }
+    }
+
+    size_t footprint() const {
+        size_t bytes = sizeof(*this) + entries.capacity() * sizeof(entry);
+        for (const entry &e : entries)
+            bytes += e.args.capacity() * sizeof(atom);
+        return bytes;
+    }
+
+    atom fn;
+    const size_t capacity;
+
+private:
+    static const uint32_t none = 0xffffffff;
+
+    struct entry {
+        std::vector<atom> args;
+        atom value;
+        size_t hash;
+        uint32_t prev;   ///< more recently used
+        uint32_t next;   ///< less recently used
+    };
+
+    static size_t hashArgs(const atom *args, size_t n) {
+        size_t h = n;
+        for (size_t i = 0; i < n; ++i)
+            h = h * 31 + atom::hash()(args[i]);
+        return h;
+    }
+
+    uint32_t lookup(const atom *args, size_t n, size_t h) const {
+        auto range = index.equal_range(h);
+        for (auto i = range.first; i != range.second; ++i) {
+            const std::vector<atom> &key = entries[i->second].args;
+            if (key.size() == n && std::equal(key.begin(), key.end(), args))
+                return i->second;
+        }
+        return none;
+    }
+
+    void drop(uint32_t i) {
+        auto range = index.equal_range(entries[i].hash);
+        for (auto k = range.first; k != range.second; ++k) {
+            if (k->second == i) {
+                index.erase(k);
+                return;
+            }
+        }
+    }
+
+    void unlink(uint32_t i) {
+        entry &e = entries[i];
+        (e.prev == none ? head : entries[e.prev].next) = e.next;
+        (e.next == none ? tail : entries[e.next].prev) = e.prev;
+    }
+
+    void pushFront(uint32_t i) {
+        entry &e = entries[i];
+        e.prev = none;
+        e.next = head;
+        (head == none ? tail : entries[head].prev) = i;
+        head = i;
+    }
+
+    std::vector<entry> entries;
+    std::unordered_multimap<size_t, uint32_t> index;
+    uint32_t head;
+    uint32_t tail;
+    std::mutex lock;
+};
+
+const uint32_t memo::none;
+
+/** mutable hash map with open addressing and linear probing, the payload of
+    MAP atoms. Slots keep the hash next to the pair, so probing compares
+    keys only on a full hash match and stays within a cache line or two.
+    Removed pairs leave tombstones behind until the table is rebuilt */
+struct hash_map : object {
+    hash_map() : used(0), dead(0) {}
+
+    /// stores the value for key to value, false when there is none
+    bool find(const atom &key, atom &value) const {
+        std::lock_guard<std::mutex> guard(lock);
+        size_t i = locate(key, hashKey(key));
+        if (slots.empty() || slots[i].hash < FIRST)
+            return false;
+        value = slots[i].value;
+        return true;
+    }
+
+    void put(const atom &key, const atom &value) {
+        std::lock_guard<std::mutex> guard(lock);
+        if ((used + dead + 1) * 4 > slots.size() * 3)
+            rehash(used * 2 + 1);
+
+        size_t h = hashKey(key);
+        size_t i = locate(key, h);
+        if (slots[i].hash < FIRST) {
+            // reuse the first tombstone on the way, if any
+            size_t mask = slots.size() - 1;
+            size_t k = h & mask;
+            while (slots[k].hash != DEAD && k != i)
+                k = (k + 1) & mask;
+            if (slots[k].hash == DEAD)
+                --dead;
+            i = k;
+            ++used;
+            slots[i].hash = h;
+            slots[i].key = key;
+        }
+        slots[i].value = value;
+    }
+
+    /// false when there was no key to remove
+    bool remove(const atom &key) {
+        std::lock_guard<std::mutex> guard(lock);
+        size_t i = locate(key, hashKey(key));
+        if (slots.empty() || slots[i].hash < FIRST)
+            return false;
+
+        slots[i] = slot();
+        slots[i].hash = DEAD;
+        --used;
+        ++dead;
+        return true;
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> guard(lock);
+        return used;
+    }
+
+    /// (key value) pairs in no particular order
+    list pairs() const {
+        std::lock_guard<std::mutex> guard(lock);
+        list::builder out;
+        for (const slot &s : slots) {
+            if (s.hash < FIRST)
+                continue;
+            list::builder pair;
+            pair.push_back(s.key);
+            pair.push_back(s.value);
+            out.push_back(atom(pair.done()));
+        }
+        return out.done();
+    }
+
+    void trace(heap &h) const {
+        for (const slot &s : slots) {
+            if (s.hash >= FIRST) {
+                h.mark(s.key);
+                h.mark(s.value);
+            }
+        }
+    }
+
+    size_t footprint() const {
+        return sizeof(*this) + slots.capacity() * sizeof(slot);
+    }
+
+private:
+    // hashes of pairs are never below FIRST
+    static const size_t EMPTY = 0;
+    static const size_t DEAD = 1;
+    static const size_t FIRST = 2;
+
+    struct slot {
+        slot() : hash(EMPTY) {}
+
+        size_t hash;
+        atom key;
+        atom value;
+    };
+
+    static size_t hashKey(const atom &key) {
+        size_t h = atom::hash()(key);
+        return h < FIRST ? h + FIRST : h;
+    }
+
+    /// slot holding key, or the empty slot ending its probe sequence
+    size_t locate(const atom &key, size_t h) const {
+        if (slots.empty())
+            return 0;
+
+        size_t mask = slots.size() - 1;
+        size_t i = h & mask;
+        while (slots[i].hash != EMPTY
+               && (slots[i].hash != h || !(slots[i].key == key)))
+            i = (i + 1) & mask;
+        return i;
+    }
+
+    /// rebuilds the table without tombstones, room for n pairs at least
+    void rehash(size_t n) {
+        size_t cap = 8;
+        while (cap * 3 < n * 4)
+            cap *= 2;
+
+        std::vector<slot> old(cap);
+        old.swap(slots);
+        heap::instance().account(cap * sizeof(slot));
+
+        size_t mask = cap - 1;
+        for (const slot &s : old) {
+            if (s.hash < FIRST)
+                continue;
+            size_t i = s.hash & mask;
+            while (slots[i].hash != EMPTY)
+                i = (i + 1) & mask;
+            slots[i] = s;
+        }
+        dead = 0;
+    }
+
+    std::vector<slot> slots;
+    size_t used;
+    size_t dead;
+    mutable std::mutex lock;
+};
+
+const size_t hash_map::EMPTY;
+const size_t hash_map::DEAD;
+const size_t hash_map::FIRST;
+
+/** node of a persistent ordered map, the payload of OMP atoms. The nodes
+    form a treap - a search tree by key and a heap by priority, which keeps
+    it balanced. Nodes never change, an update copies the path from the
+    root to the changed node, so every version of a map stays valid and
+    shares all other nodes with the rest */
+struct tree_node : object {
+    tree_node(const atom &key, const atom &value, const tree_node *left,
+              const tree_node *right, size_t prio)
+        : key(key), value(value), left(left), right(right),
+          size(1 + count(left) + count(right)), prio(prio)
+    {}
+
+    static size_t count(const tree_node *t) {
+        return t ? t->size : 0;
+    }
+
+    static const tree_node *find(const tree_node *t, const atom &key);
+
+    /// map with key bound to value
+    static const tree_node *insert(const tree_node *t, const atom &key,
+                                   const atom &value);
+
+    /// map without key
+    static const tree_node *remove(const tree_node *t, const atom &key);
+
+    /// nodes of the map in key order
+    static void inorder(const tree_node *t,
+                        std::vector<const tree_node *> &out);
+
+    void trace(heap &h) const {
+        h.mark(key);
+        h.mark(value);
+        h.mark(left);
+        h.mark(right);
+    }
+
+    size_t footprint() const {
+        return sizeof(*this);
+    }
+
+    // not const only so that images can be loaded, see image::loader
+    atom key;
+    atom value;
+    const tree_node *left;
+    const tree_node *right;
+    size_t size;
+    size_t prio;
+
+private:
+    static const tree_node *make(const atom &key, const atom &value,
+                                 const tree_node *left,
+                                 const tree_node *right, size_t prio) {
+        return heap::instance().make<tree_node>(key, value, left, right,
+                                                prio);
+    }
+
+    static const tree_node *insert(const tree_node *t, const atom &key,
+                                   const atom &value, size_t prio);
+
+    /// joins maps whose keys are all below (a) and above (b) each other
+    static const tree_node *join(const tree_node *a, const tree_node *b);
+};
+
+void list::block::trace(heap &h) const {
+    for (size_t i = lo; i < items.size(); ++i)
+        h.mark(items[i]);
+    h.mark(tail.b);
+}
+
+size_t list::block::footprint() const {
+    return sizeof(*this) + items.capacity() * sizeof(atom);
+}
+
+list list::cons(const atom &a) const {
+    heap &h = heap::instance();
+
+    // the slot below the list is free unless another cons took it first
+    size_t expected = off;
+    if (b && off > 0 && b->lo.compare_exchange_strong(expected, off - 1)) {
+        b->items[off - 1] = a;
+        return list(b, off - 1);
+    }
+
+    // blocks double in size along a chain of conses, up to a limit, so long
+    // consed lists stay a short chain of large blocks
+    const size_t max_block = 1024;
+    size_t cap = 4;
+    if (b)
+        cap = std::min(max_block,
+                       std::max(cap, 2 * (b->items.size() - off)));
+
+    block *nb = h.make<block>();
+    nb->items.resize(cap);
+    nb->lo = cap - 1;
+    nb->items[cap - 1] = a;
+    nb->tail = *this;
+    nb->tail_size = size();
+    h.account(cap * sizeof(atom));
+    return list(nb, cap - 1);
+}
+
+void list::builder::start() {
+    if (!b)
+        b = heap::instance().make<block>();
+}
+
+void list::builder::push_back(const atom &a) {
+    start();
+    b->items.push_back(a);
+}
+
+void list::builder::push_back(atom &&a) {
+    start();
+    b->items.push_back(std::move(a));
+}
+
+list list::builder::done(const list &rest) {
+    if (!b)
+        return rest;
+
+    b->tail = rest;
+    b->tail_size = rest.size();
+    heap::instance().account(b->items.capacity() * sizeof(atom));
+
+    list result(b, 0);
+    b = nullptr;
+    return result;
+}
+
+void heap::mark(const atom &a) {
+    switch (a.t) {
+    case atom::LST:
+        mark(a.lb);
+        break;
+    case atom::LMB:
+        mark(a.cl);
+        break;
+    case atom::BIG:
+        mark(a.bg);
+        break;
+    case atom::VEC:
+        mark(a.pv);
+        break;
+    case atom::FUT:
+        mark(a.tk);
+        break;
+    case atom::MEM:
+        mark(a.mm);
+        break;
+    case atom::MAP:
+        mark(a.hm);
+        break;
+    case atom::OMP:
+        mark(a.tn);
+        break;
+    case atom::STR:
+        if (!a.n)
+            mark(a.st);
+        break;
+    case atom::BLD:
+        mark(a.tb);
+        break;
+    default:
+        break;
+    }
+}
+
+bool heap::marked(const atom &a) const {
+    const object *o;
+    switch (a.t) {
+    case atom::LST: o = a.lb; break;
+    case atom::LMB: o = a.cl; break;
+    case atom::BIG: o = a.bg; break;
+    case atom::VEC: o = a.pv; break;
+    case atom::FUT: o = a.tk; break;
+    case atom::MEM: o = a.mm; break;
+    case atom::MAP: o = a.hm; break;
+    case atom::OMP: o = a.tn; break;
+    case atom::STR: o = a.n ? nullptr : a.st; break;
+    case atom::BLD: o = a.tb; break;
+    default: return true;
+    }
+    return !o || o->marked;
+}
+
+const atom &atom::lambda_definition() const {
+    expect(LMB);
+    return cl->body->definition;
+}
+
+const code &atom::lambda_code() const {
+    expect(LMB);
+    return *cl->body;
+}
+
+atom atom::lambda(code *c) {
+    atom l(LMB);
+    l.cl = heap::instance().make<closure>(c, nullptr, nullptr);
+    return l;
+}
+
+atom atom::bind(frame *outer, environment &globals) const {
+    expect(LMB);
+    atom l(LMB);
+    l.cl = heap::instance().make<closure>(cl->body, outer,
+                                          globals.link());
+    return l;
+}
+
+atom atom::big(bigint &&v) {
+    int64_t i;
+    if (v.fits(i))
+        return atom(i);
+
+    heap &h = heap::instance();
+    atom a(BIG);
+    a.bg = h.make<bignum>(std::move(v));
+    h.account(a.bg->v.mag.capacity() * sizeof(uint32_t));
+    return a;
+}
+
+double atom::asReal() const {
+    switch (t) {
+    case INT:
+        return static_cast<double>(iv);
+    case FLT:
+        return dv;
+    case BIG:
+        return bg->v.toDouble();
+    default:
+        throw std::invalid_argument(std::string("Unexpected type ")
+                                    + strtype(t) + ", expected a number");
+    }
+}
+
+bigint atom::asBig() const {
+    if (t == BIG)
+        return bg->v;
+    return bigint(asInt());
+}
+
+/* numeric tower. Two INTs take an overflow checked fast path and promote to
+   bignums when it overflows, anything involving a float is computed in
+   doubles, everything else in bigints. Results are demoted back to INT
+   whenever they fit */
+enum num_rank {
+    RANK_INT,
+    RANK_BIG,
+    RANK_FLT
+};
+
+num_rank rankOf(const atom &a, const atom &b) {
+    if (!a.isNumber() || !b.isNumber())
+        throw std::invalid_argument("Arithmetic on "
+                                    + (a.isNumber() ? b : a).repr());
+
+    if (a.type() == atom::FLT || b.type() == atom::FLT)
+        return RANK_FLT;
+    if (a.type() == atom::BIG || b.type() == atom::BIG)
+        return RANK_BIG;
+    return RANK_INT;
+}
+
+atom numAdd(const atom &a, const atom &b) {
+    int64_t r;
+    if (a.type() == atom::INT && b.type() == atom::INT
+        && !__builtin_add_overflow(a.asInt(), b.asInt(), &r))
+        return atom(r);
+
+    if (rankOf(a, b) == RANK_FLT)
+        return atom(a.asReal() + b.asReal());
+    return atom::big(bigint::add(a.asBig(), b.asBig()));
+}
+
+atom numSub(const atom &a, const atom &b) {
+    int64_t r;
+    if (a.type() == atom::INT && b.type() == atom::INT
+        && !__builtin_sub_overflow(a.asInt(), b.asInt(), &r))
+        return atom(r);
+
+    if (rankOf(a, b) == RANK_FLT)
+        return atom(a.asReal() - b.asReal());
+    return atom::big(bigint::sub(a.asBig(), b.asBig()));
+}
+
+atom numMul(const atom &a, const atom &b) {
+    int64_t r;
+    if (a.type() == atom::INT && b.type() == atom::INT
+        && !__builtin_mul_overflow(a.asInt(), b.asInt(), &r))
+        return atom(r);
+
+    if (rankOf(a, b) == RANK_FLT)
+        return atom(a.asReal() * b.asReal());
+    return atom::big(bigint::mul(a.asBig(), b.asBig()));
+}
+
+/** integer division stays exact when the divisor divides evenly, otherwise
+    the quotient is a float */
+atom numDiv(const atom &a, const atom &b) {
+    num_rank rank = rankOf(a, b);
+    if (rank == RANK_FLT)
+        return atom(a.asReal() / b.asReal());
+
+    if (b.type() == atom::INT && b.asInt() == 0)
+        throw std::invalid_argument("Division by zero");
+
+    if (rank == RANK_INT) {
+        int64_t x = a.asInt(), y = b.asInt();
+        if (y == -1)
+            return numSub(atom(0), a);
+        if (x % y == 0)
+            return atom(x / y);
+        return atom(static_cast<double>(x) / static_cast<double>(y));
+    }
+
+    bigint rem;
+    bigint q = bigint::div(a.asBig(), b.asBig(), rem);
+    if (rem.zero())
+        return atom::big(std::move(q));
+    return atom(a.asReal() / b.asReal());
+}
+
+/// -1, 0 or 1 as a is less, equal or greater than b, 2 if unordered (nan)
+int numCompare(const atom &a, const atom &b) {
+    if (a.type() == atom::INT && b.type() == atom::INT) {
+        int64_t x = a.asInt(), y = b.asInt();
+        return x < y ? -1 : x > y;
+    }
+
+    if (rankOf(a, b) == RANK_FLT) {
+        double x = a.asReal(), y = b.asReal();
+        if (x < y)
+            return -1;
+        if (x > y)
+            return 1;
+        return x == y ? 0 : 2;
+    }
+
+    return bigint::compare(a.asBig(), b.asBig());
+}
+
+/* kernels over packed vectors. The main loops work on four lanes at once
+   using the compiler's vector extensions, the remaining elements (all of
+   them without vector support) go through a scalar loop. GCC builds each
+   kernel for AVX2, SSE4.2 and the baseline instruction set and picks the
+   best one for the CPU at load time */
+#if defined(__GNUC__)
+#define LISPY_VECTORS
+typedef double real_lanes
+        __attribute__((vector_size(32), aligned(8), may_alias));
+typedef int64_t int_lanes
+        __attribute__((vector_size(32), aligned(8), may_alias));
+typedef uint64_t uint_lanes
+        __attribute__((vector_size(32), aligned(8), may_alias));
+const size_t vector_lanes = 4;
+#endif
+
+// clone resolvers run before ThreadSanitizer is set up, so not under it
+#if defined(LISPY_VECTORS) && defined(__x86_64__) && !defined(__clang__) \
+    && !defined(__SANITIZE_THREAD__)
+#define LISPY_SIMD __attribute__((target_clones("avx2", "sse4.2", "default")))
+#else
+#define LISPY_SIMD
+#endif
+
+enum packed_op {
+    PACK_ADD,
+    PACK_SUB,
+    PACK_MUL,
+    PACK_DIV,
+    PACK_MIN,
+    PACK_MAX,
+    PACK_LT,
+    PACK_GT,
+    PACK_EQ
+};
+
+/// elementwise add, sub, mul or div of doubles
+LISPY_SIMD
+void packedReal(packed_op op, const double *a, const double *b, double *out,
+                size_t n)
+{
+    size_t i = 0;
+#ifdef LISPY_VECTORS
+    const real_lanes *va = reinterpret_cast<const real_lanes *>(a);
+    const real_lanes *vb = reinterpret_cast<const real_lanes *>(b);
+    real_lanes *vo = reinterpret_cast<real_lanes *>(out);
+    size_t blocks = n / vector_lanes;
+    switch (op) {
+    case PACK_ADD:
+        for (size_t k = 0; k < blocks; ++k)
+            vo[k] = va[k] + vb[k];
+        break;
+    case PACK_SUB:
+        for (size_t k = 0; k < blocks; ++k)
+            vo[k] = va[k] - vb[k];
+        break;
+    case PACK_MUL:
+        for (size_t k = 0; k < blocks; ++k)
+            vo[k] = va[k] * vb[k];
+        break;
+    default:
+        for (size_t k = 0; k < blocks; ++k)
+            vo[k] = va[k] / vb[k];
+        break;
+    }
+    i = blocks * vector_lanes;
+#endif
+    for (; i < n; ++i) {
+        switch (op) {
+        case PACK_ADD: out[i] = a[i] + b[i]; break;
+        case PACK_SUB: out[i] = a[i] - b[i]; break;
+        case PACK_MUL: out[i] = a[i] * b[i]; break;
+        default: out[i] = a[i] / b[i]; break;
+        }
+    }
+}
+
+/// elementwise add, sub or mul of integers, false if any of them overflows
+LISPY_SIMD
+bool packedInt(packed_op op, const int64_t *a, const int64_t *b,
+               int64_t *out, size_t n)
+{
+    size_t i = 0;
+#ifdef LISPY_VECTORS
+    // sums are computed wrapping, overflow shows in the sign bits
+    if (op != PACK_MUL) {
+        const int_lanes *va = reinterpret_cast<const int_lanes *>(a);
+        const int_lanes *vb = reinterpret_cast<const int_lanes *>(b);
+        int_lanes *vo = reinterpret_cast<int_lanes *>(out);
+        int_lanes overflow = {0, 0, 0, 0};
+        size_t blocks = n / vector_lanes;
+        for (size_t k = 0; k < blocks; ++k) {
+            uint_lanes x = (uint_lanes)va[k], y = (uint_lanes)vb[k];
+            int_lanes r = (int_lanes)(op == PACK_ADD ? x + y : x - y);
+            if (op == PACK_ADD)
+                overflow |= (va[k] ^ r) & (vb[k] ^ r);
+            else
+                overflow |= (va[k] ^ vb[k]) & (va[k] ^ r);
+            vo[k] = r;
+        }
+        for (size_t l = 0; l < vector_lanes; ++l)
+            if (overflow[l] < 0)
+                return false;
+        i = blocks * vector_lanes;
+    }
+#endif
+    for (; i < n; ++i) {
+        bool overflow;
+        switch (op) {
+        case PACK_ADD:
+            overflow = __builtin_add_overflow(a[i], b[i], &out[i]);
+            break;
+        case PACK_SUB:
+            overflow = __builtin_sub_overflow(a[i], b[i], &out[i]);
+            break;
+        default:
+            overflow = __builtin_mul_overflow(a[i], b[i], &out[i]);
+            break;
+        }
+        if (overflow)
+            return false;
+    }
+    return true;
+}
+
+/// elementwise lt, gt or eq of doubles, the mask holds 1 where it holds
+LISPY_SIMD
+void packedCompareReal(packed_op op, const double *a, const double *b,
+                       int64_t *mask, size_t n)
+{
+    size_t i = 0;
+#ifdef LISPY_VECTORS
+    const real_lanes *va = reinterpret_cast<const real_lanes *>(a);
+    const real_lanes *vb = reinterpret_cast<const real_lanes *>(b);
+    int_lanes *vm = reinterpret_cast<int_lanes *>(mask);
+    size_t blocks = n / vector_lanes;
+    // vector comparisons yield -1 for true
+    switch (op) {
+    case PACK_LT:
+        for (size_t k = 0; k < blocks; ++k)
+            vm[k] = -(va[k] < vb[k]);
+        break;
+    case PACK_GT:
+        for (size_t k = 0; k < blocks; ++k)
+            vm[k] = -(va[k] > vb[k]);
+        break;
+    default:
+        for (size_t k = 0; k < blocks; ++k)
+            vm[k] = -(va[k] == vb[k]);
+        break;
+    }
+    i = blocks * vector_lanes;
+#endif
+    for (; i < n; ++i) {
+        switch (op) {
+        case PACK_LT: mask[i] = a[i] < b[i]; break;
+        case PACK_GT: mask[i] = a[i] > b[i]; break;
+        default: mask[i] = a[i] == b[i]; break;
+        }
+    }
+}
+
+/// elementwise lt, gt or eq of integers, the mask holds 1 where it holds
+LISPY_SIMD
+void packedCompareInt(packed_op op, const int64_t *a, const int64_t *b,
+                      int64_t *mask, size_t n)
+{
+    size_t i = 0;
+#ifdef LISPY_VECTORS
+    const int_lanes *va = reinterpret_cast<const int_lanes *>(a);
+    const int_lanes *vb = reinterpret_cast<const int_lanes *>(b);
+    int_lanes *vm = reinterpret_cast<int_lanes *>(mask);
+    size_t blocks = n / vector_lanes;
+    switch (op) {
+    case PACK_LT:
+        for (size_t k = 0; k < blocks; ++k)
+            vm[k] = -(va[k] < vb[k]);
+        break;
+    case PACK_GT:
+        for (size_t k = 0; k < blocks; ++k)
+            vm[k] = -(va[k] > vb[k]);
+        break;
+    default:
+        for (size_t k = 0; k < blocks; ++k)
+            vm[k] = -(va[k] == vb[k]);
+        break;
+    }
+    i = blocks * vector_lanes;
+#endif
+    for (; i < n; ++i) {
+        switch (op) {
+        case PACK_LT: mask[i] = a[i] < b[i]; break;
+        case PACK_GT: mask[i] = a[i] > b[i]; break;
+        default: mask[i] = a[i] == b[i]; break;
+        }
+    }
+}
+
+/// sum, min or max of doubles, n has to be positive for min and max
+LISPY_SIMD
+double packedReduceReal(packed_op op, const double *a, size_t n) {
+    double r = op == PACK_ADD ? 0.0 : a[0];
+    size_t i = 0;
+#ifdef LISPY_VECTORS
+    const real_lanes *va = reinterpret_cast<const real_lanes *>(a);
+    size_t blocks = n / vector_lanes;
+    if (blocks) {
+        real_lanes acc = va[0];
+        for (size_t k = 1; k < blocks; ++k) {
+            switch (op) {
+            case PACK_ADD: acc += va[k]; break;
+            case PACK_MIN: acc = va[k] < acc ? va[k] : acc; break;
+            default: acc = va[k] > acc ? va[k] : acc; break;
+            }
+        }
+        for (size_t l = 0; l < vector_lanes; ++l) {
+            switch (op) {
+            case PACK_ADD: r += acc[l]; break;
+            case PACK_MIN: r = std::min(r, acc[l]); break;
+            default: r = std::max(r, acc[l]); break;
+            }
+        }
+        i = blocks * vector_lanes;
+    }
+#endif
+    for (; i < n; ++i) {
+        switch (op) {
+        case PACK_ADD: r += a[i]; break;
+        case PACK_MIN: r = std::min(r, a[i]); break;
+        default: r = std::max(r, a[i]); break;
+        }
+    }
+    return r;
+}
+
+/** sum, min or max of integers into r, n has to be positive for min and
+    max. False if the sum overflows */
+LISPY_SIMD
+bool packedReduceInt(packed_op op, const int64_t *a, size_t n, int64_t &r) {
+    r = op == PACK_ADD ? 0 : a[0];
+    size_t i = 0;
+#ifdef LISPY_VECTORS
+    const int_lanes *va = reinterpret_cast<const int_lanes *>(a);
+    size_t blocks = n / vector_lanes;
+    if (blocks) {
+        int_lanes acc = va[0];
+        int_lanes overflow = {0, 0, 0, 0};
+        for (size_t k = 1; k < blocks; ++k) {
+            switch (op) {
+            case PACK_ADD: {
+                int_lanes s = (int_lanes)((uint_lanes)acc + (uint_lanes)va[k]);
+                overflow |= (acc ^ s) & (va[k] ^ s);
+                acc = s;
+                break;
+            }
+            case PACK_MIN: acc = va[k] < acc ? va[k] : acc; break;
+            default: acc = va[k] > acc ? va[k] : acc; break;
+            }
+        }
+        for (size_t l = 0; l < vector_lanes; ++l) {
+            switch (op) {
+            case PACK_ADD:
+                if (overflow[l] < 0 || __builtin_add_overflow(r, acc[l], &r))
+                    return false;
+                break;
+            case PACK_MIN: r = std::min<int64_t>(r, acc[l]); break;
+            default: r = std::max<int64_t>(r, acc[l]); break;
+            }
+        }
+        i = blocks * vector_lanes;
+    }
+#endif
+    for (; i < n; ++i) {
+        switch (op) {
+        case PACK_ADD:
+            if (__builtin_add_overflow(r, a[i], &r))
+                return false;
+            break;
+        case PACK_MIN: r = std::min(r, a[i]); break;
+        default: r = std::max(r, a[i]); break;
+        }
+    }
+    return true;
+}
+
+/// dot product of doubles
+LISPY_SIMD
+double packedDotReal(const double *a, const double *b, size_t n) {
+    double r = 0;
+    size_t i = 0;
+#ifdef LISPY_VECTORS
+    const real_lanes *va = reinterpret_cast<const real_lanes *>(a);
+    const real_lanes *vb = reinterpret_cast<const real_lanes *>(b);
+    real_lanes acc = {0, 0, 0, 0};
+    size_t blocks = n / vector_lanes;
+    for (size_t k = 0; k < blocks; ++k)
+        acc += va[k] * vb[k];
+    for (size_t l = 0; l < vector_lanes; ++l)
+        r += acc[l];
+    i = blocks * vector_lanes;
+#endif
+    for (; i < n; ++i)
+        r += a[i] * b[i];
+    return r;
+}
+
+/* packed vector builtins. Either operand of an elementwise operation may
+   be a plain number, which is used for every element. Integer vectors are
+   widened to doubles when mixed with floats */
+atom atom::vec(bool real, size_t n, packed *&p) {
+    heap &h = heap::instance();
+    p = h.make<packed>(real, n);
+    h.account(n * 8);
+    atom a(VEC);
+    a.pv = p;
+    return a;
+}
+
+/// length of the vector among a and b, which have to agree
+size_t packedLength(const atom &a, const atom &b) {
+    if (a.type() == atom::VEC && b.type() == atom::VEC
+        && a.asPacked().size() != b.asPacked().size())
+        throw std::invalid_argument("Packed vectors differ in length");
+    if (a.type() == atom::VEC)
+        return a.asPacked().size();
+    if (b.type() == atom::VEC)
+        return b.asPacked().size();
+    throw std::invalid_argument("Expected a packed vector");
+}
+
+bool isRealPacked(const atom &a) {
+    return a.type() == atom::VEC ? a.asPacked().real : a.type() == atom::FLT;
+}
+
+/// elements of a as doubles, copied to tmp unless a is a real vector
+const double *realElements(const atom &a, size_t n, std::vector<double> &tmp)
+{
+    if (a.type() == atom::VEC && a.asPacked().real)
+        return a.asPacked().reals.data();
+
+    if (a.type() == atom::VEC) {
+        const std::vector<int64_t> &ints = a.asPacked().ints;
+        tmp.assign(ints.begin(), ints.end());
+    } else {
+        tmp.assign(n, a.asReal());
+    }
+    return tmp.data();
+}
+
+/// elements of a as integers, copied to tmp unless a is an integer vector
+const int64_t *intElements(const atom &a, size_t n, std::vector<int64_t> &tmp)
+{
+    if (a.type() == atom::VEC)
+        return a.asPacked().ints.data();
+    tmp.assign(n, a.asInt());
+    return tmp.data();
+}
+
+atom packedZip(packed_op op, const atom &a, const atom &b) {
+    size_t n = packedLength(a, b);
+    packed *p;
+
+    if (op == PACK_DIV || isRealPacked(a) || isRealPacked(b)) {
+        std::vector<double> ta, tb;
+        const double *x = realElements(a, n, ta), *y = realElements(b, n, tb);
+        bool mask = op == PACK_LT || op == PACK_GT || op == PACK_EQ;
+        atom r = atom::vec(!mask, n, p);
+        if (mask)
+            packedCompareReal(op, x, y, p->ints.data(), n);
+        else
+            packedReal(op, x, y, p->reals.data(), n);
+        return r;
+    }
+
+    std::vector<int64_t> ta, tb;
+    const int64_t *x = intElements(a, n, ta), *y = intElements(b, n, tb);
+    atom r = atom::vec(false, n, p);
+    if (op == PACK_LT || op == PACK_GT || op == PACK_EQ)
+        packedCompareInt(op, x, y, p->ints.data(), n);
+    else if (!packedInt(op, x, y, p->ints.data(), n))
+        throw std::invalid_argument("Integer overflow in packed vector");
+    return r;
+}
+
+atom packedReduce(packed_op op, const atom &v) {
+    const packed &p = v.asPacked();
+    if (op != PACK_ADD && !p.size())
+        throw std::invalid_argument("Empty packed vector");
+
+    if (p.real)
+        return atom(packedReduceReal(op, p.reals.data(), p.size()));
+
+    int64_t r;
+    if (packedReduceInt(op, p.ints.data(), p.size(), r))
+        return atom(r);
+
+    // the sum overflowed, redo it exactly
+    atom sum(0);
+    for (int64_t i : p.ints)
+        sum = numAdd(sum, atom(i));
+    return sum;
+}
+
+/// packed vector of n numbers, real if any of them is a float
+atom packNumbers(const atom *v, size_t n) {
+    bool real = false;
+    for (size_t i = 0; i < n; ++i) {
+        if (v[i].type() == atom::FLT)
+            real = true;
+        else if (v[i].type() != atom::INT)
+            throw std::invalid_argument(
+                    std::string("Cannot pack ") + atom::strtype(v[i].type()));
+    }
+
+    packed *p;
+    atom r = atom::vec(real, n, p);
+    for (size_t i = 0; i < n; ++i) {
+        if (real)
+            p->reals[i] = v[i].asReal();
+        else
+            p->ints[i] = v[i].asInt();
+    }
+    return r;
+}
+
+atom packedDot(const atom &a, const atom &b) {
+    size_t n = packedLength(a, b);
+
+    if (isRealPacked(a) || isRealPacked(b)) {
+        std::vector<double> ta, tb;
+        return atom(packedDotReal(realElements(a, n, ta),
+                                  realElements(b, n, tb), n));
+    }
+
+    // no 64 bit lane multiply to speak of, integers are summed exactly
+    std::vector<int64_t> ta, tb;
+    const int64_t *x = intElements(a, n, ta), *y = intElements(b, n, tb);
+    atom sum(0);
+    for (size_t i = 0; i < n; ++i)
+        sum = numAdd(sum, numMul(atom(x[i]), atom(y[i])));
+    return sum;
+}
+
+/// scatters the bits of v, so that nearby values hash far apart
+size_t mixBits(uint64_t v) {
+    v ^= v >> 30;
+    v *= 0xbf58476d1ce4e5b9ULL;
+    v ^= v >> 27;
+    v *= 0x94d049bb133111ebULL;
+    return static_cast<size_t>(v ^ (v >> 31));
+}
+
+/* nested lists and maps are compared, hashed and ordered with a worklist
+   of their elements rather than by recursion, as heap::mark does, so that
+   no amount of nesting can overflow the stack */
+
+bool atom::operator==(const atom &other) const {
+    std::vector<std::pair<const atom *, const atom *>> pending;
+    const atom *x = this, *y = &other;
+    for (;;) {
+        if (!equalShallow(*x, *y, pending))
+            return false;
+        if (pending.empty())
+            return true;
+        x = pending.back().first;
+        y = pending.back().second;
+        pending.pop_back();
+    }
+}
+
+bool atom::equalShallow(const atom &a, const atom &b,
+                        std::vector<std::pair<const atom *,
+                                              const atom *>> &pending) {
+    if (a.t != b.t)
+        return false;
+    switch (a.t) {
+    case NIL:
+        return true;
+    case INT:
+        return a.iv == b.iv;
+    case FLT:
+        return a.dv == b.dv;
+    case BIG:
+        return bigint::compare(a.bg->v, b.bg->v) == 0;
+    case SYM:
+        return a.sy == b.sy;
+    case LST: {
+        list x = a.asList(), y = b.asList();
+        if (x.size() != y.size())
+            return false;
+
+        list::const_iterator i = x.begin(), k = y.begin();
+        for (; i != x.end(); ++i, ++k) {
+            // the rest is shared, hash consed lists always end up here
+            if (i == k)
+                break;
+            pending.push_back(std::make_pair(&*i, &*k));
+        }
+        return true;
+    }
+    case VEC:
+        if (a.pv->real != b.pv->real)
+            return false;
+        return a.pv->real ? a.pv->reals == b.pv->reals
+                          : a.pv->ints == b.pv->ints;
+    case OMP: {
+        if (a.tn == b.tn)
+            return true;
+        if (tree_node::count(a.tn) != tree_node::count(b.tn))
+            return false;
+
+        std::vector<const tree_node *> x, y;
+        tree_node::inorder(a.tn, x);
+        tree_node::inorder(b.tn, y);
+        for (size_t i = 0; i < x.size(); ++i) {
+            pending.push_back(std::make_pair(&x[i]->key, &y[i]->key));
+            pending.push_back(std::make_pair(&x[i]->value, &y[i]->value));
+        }
+        return true;
+    }
+    case STR:
+        return a.textSize() == b.textSize() && a.asText() == b.asText();
+    case PRC:
+    case LMB:
+    case FUT:
+    case MEM:
+    case MAP:
+    case BLD:
+        return a.p == b.p;
+    }
+    return false;
+}
+
+size_t atom::hash::operator()(const atom &a) const {
+    // elements are mixed in in the order the worklist visits them, after
+    // the type and size of the list or map they are in
+    std::vector<const atom *> pending;
+    size_t h = shallow(a, pending);
+    while (!pending.empty()) {
+        const atom *e = pending.back();
+        pending.pop_back();
+        h = h * 31 + shallow(*e, pending);
+    }
+    return h;
+}
+
+size_t atom::hash::shallow(const atom &a,
+                           std::vector<const atom *> &pending) const {
+    size_t h = mixBits(a.t);
+    switch (a.t) {
+    case NIL:
+        return h;
+    case INT:
+        return mixBits(a.iv);
+    case FLT: {
+        // 0.0 and -0.0 are equal
+        double d = a.dv == 0 ? 0 : a.dv;
+        uint64_t bits;
+        std::memcpy(&bits, &d, sizeof(bits));
+        return mixBits(bits ^ h);
+    }
+    case BIG:
+        for (uint32_t l : a.bg->v.mag)
+            h = h * 31 + l;
+        return mixBits(h + a.bg->v.neg);
+    case SYM:
+        return mixBits(a.sy.id() ^ h);
+    case LST: {
+        list l = a.asList();
+        for (list::const_iterator i = l.begin(); i != l.end(); ++i)
+            pending.push_back(&*i);
+        return mixBits(l.size() ^ h);
+    }
+    case VEC:
+        // elements are numbers, there is nothing nested to visit
+        for (size_t i = 0; i < a.pv->size(); ++i)
+            h = h * 31 + (*this)(a.pv->at(i));
+        return h;
+    case OMP: {
+        std::vector<const tree_node *> nodes;
+        tree_node::inorder(a.tn, nodes);
+        for (const tree_node *t : nodes) {
+            pending.push_back(&t->key);
+            pending.push_back(&t->value);
+        }
+        return mixBits(nodes.size() ^ h);
+    }
+    case STR:
+        return mixBits(str_view::hash()(a.asText()) ^ h);
+    default:
+        return mixBits(reinterpret_cast<uintptr_t>(a.p) ^ h);
+    }
+}
+
+/** canonical copies of lists. Lists passed through hashcons() share their
+    memory with every structurally equal list passed before, which turns
+    comparing them into a pointer comparison. The table only holds lists
+    someone else refers to, the rest is dropped by the collector */
+class list_table : public weak_set {
+public:
+    static list_table &instance() {
+        static list_table *t = new list_table();
+        return *t;
+    }
+
+    /** canonical copy of a, elements included. Nested lists are interned
+        innermost first from a stack of the lists being visited, so deep
+        nesting cannot overflow the C++ stack. A list whose elements are
+        canonical already is interned as it is, without copying */
+    atom intern(const atom &a) {
+        if (!nested(a))
+            return a;
+
+        struct visit {
+            list source;
+            list::const_iterator next;
+            std::vector<atom> elements;     ///< interned so far
+            bool copied;                    ///< some of them changed
+        };
+        std::vector<visit> pending;
+        pending.push_back(visit{a.asList(), a.asList().begin(), {}, false});
+
+        for (;;) {
+            visit &top = pending.back();
+            if (top.next != top.source.end()) {
+                const atom &e = *top.next;
+                ++top.next;
+                if (nested(e))
+                    pending.push_back(visit{e.asList(), e.asList().begin(),
+                                            {}, false});
+                else
+                    top.elements.push_back(e);
+                continue;
+            }
+
+            atom l(top.source);
+            if (top.copied) {
+                list::builder b;
+                for (const atom &e : top.elements)
+                    b.push_back(e);
+                l = atom(b.done());
+            }
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                l = *lists.insert(l).first;
+            }
+
+            bool changed = !same(l, atom(top.source));
+            pending.pop_back();
+            if (pending.empty())
+                return l;
+
+            pending.back().copied = pending.back().copied || changed;
+            pending.back().elements.push_back(l);
+        }
+    }
+
+    void prune(const heap &h) {
+        for (set::iterator i = lists.begin(); i != lists.end();) {
+            if (h.marked(*i))
+                ++i;
+            else
+                i = lists.erase(i);
+        }
+    }
+
+private:
+    static bool nested(const atom &a) {
+        return a.type() == atom::LST && !a.asList().empty();
+    }
+
+    /// the very same list, or equal values of any other type
+    static bool same(const atom &a, const atom &b) {
+        if (!nested(a) || !nested(b))
+            return a == b;
+        return &a.asList().front() == &b.asList().front();
+    }
+
+    /* lists in the table only hold canonical nested lists, so those are
+       hashed and compared by identity rather than by their contents, and
+       interning takes time linear in the size of its argument */
+    struct shallow_hash {
+        size_t operator()(const atom &l) const {
+            size_t h = l.asList().size();
+            for (const atom &e : l.asList()) {
+                h = h * 31 + (nested(e)
+                        ? std::hash<const atom *>()(&e.asList().front())
+                        : atom::hash()(e));
+            }
+            return h;
+        }
+    };
+
+    struct shallow_equal {
+        bool operator()(const atom &a, const atom &b) const {
+            list x = a.asList(), y = b.asList();
+            if (x.size() != y.size())
+                return false;
+            list::const_iterator i = x.begin(), k = y.begin();
+            for (; i != x.end(); ++i, ++k) {
+                if (i == k)
+                    return true;
+                if (!same(*i, *k))
+                    return false;
+            }
+            return true;
+        }
+    };
+
+    typedef std::unordered_set<atom, shallow_hash, shallow_equal> set;
+
+    list_table() {
+        heap::instance().add_weak(this);
+    }
+
+    std::mutex lock;
+    set lists;
+};
+
+/** total order of atoms, consistent with operator==. Numbers come first
+    and compare by value, then symbols by name, strings by their characters,
+    lists, vectors and ordered maps element by element. Other values are
+    ordered by their type and identity */
+int compareAtoms(const atom &first, const atom &second) {
+    static const int rank[] = {0, 1, 2, 4, 7, 7, 1, 1, 5, 7, 7, 7, 6, 3, 7};
+
+    /* pairs of elements still to compare, the first one on top. An entry
+       without atoms follows the elements of a list or map and holds the
+       result of comparing their sizes, for when all of them are equal */
+    struct step {
+        const atom *a;
+        const atom *b;
+        int sizes;
+    };
+    std::vector<step> pending;
+
+    const atom *x = &first, *y = &second;
+    for (;;) {
+        const atom &a = *x, &b = *y;
+        int ra = rank[a.t], rb = rank[b.t];
+        if (ra != rb)
+            return ra < rb ? -1 : 1;
+
+        int c = 0;
+        switch (a.t) {
+        case atom::NIL:
+            break;
+        case atom::INT:
+        case atom::FLT:
+        case atom::BIG:
+            c = numCompare(a, b);
+            if (c == 2) {
+                // NaN is placed after all other numbers
+                bool na = a.t == atom::FLT && a.dv != a.dv;
+                bool nb = b.t == atom::FLT && b.dv != b.dv;
+                c = na == nb ? 0 : na ? 1 : -1;
+            }
+            if (!c && a.t != b.t)
+                c = a.t < b.t ? -1 : 1;
+            break;
+        case atom::SYM:
+            c = a.sy == b.sy ? 0 : a.sy.name().compare(b.sy.name());
+            c = c < 0 ? -1 : c > 0;
+            break;
+        case atom::STR: {
+            str_view u = a.asText(), v = b.asText();
+            c = std::memcmp(u.begin(), v.begin(),
+                            std::min(u.size(), v.size()));
+            if (!c)
+                c = u.size() == v.size() ? 0 : u.size() < v.size() ? -1 : 1;
+            c = c < 0 ? -1 : c > 0;
+            break;
+        }
+        case atom::LST: {
+            list u = a.asList(), v = b.asList();
+            pending.push_back(step{nullptr, nullptr,
+                                   u.size() == v.size() ? 0
+                                   : u.size() < v.size() ? -1 : 1});
+            size_t top = pending.size();
+            list::const_iterator i = u.begin(), k = v.begin();
+            for (; i != u.end() && k != v.end(); ++i, ++k) {
+                // the rest is shared, so are the sizes
+                if (i == k)
+                    break;
+                pending.push_back(step{&*i, &*k, 0});
+            }
+            std::reverse(pending.begin() + top, pending.end());
+            break;
+        }
+        case atom::VEC: {
+            // elements are numbers, compared without nesting any further
+            size_t n = std::min(a.pv->size(), b.pv->size());
+            for (size_t i = 0; i < n && !c; ++i)
+                c = compareAtoms(a.pv->at(i), b.pv->at(i));
+            if (!c && a.pv->size() != b.pv->size())
+                c = a.pv->size() < b.pv->size() ? -1 : 1;
+            break;
+        }
+        case atom::OMP: {
+            if (a.tn == b.tn)
+                break;
+            std::vector<const tree_node *> u, v;
+            tree_node::inorder(a.tn, u);
+            tree_node::inorder(b.tn, v);
+            pending.push_back(step{nullptr, nullptr,
+                                   u.size() == v.size() ? 0
+                                   : u.size() < v.size() ? -1 : 1});
+            for (size_t i = std::min(u.size(), v.size()); i-- > 0;) {
+                pending.push_back(step{&u[i]->value, &v[i]->value, 0});
+                pending.push_back(step{&u[i]->key, &v[i]->key, 0});
+            }
+            break;
+        }
+        default:
+            if (a.t != b.t)
+                c = a.t < b.t ? -1 : 1;
+            else
+                c = std::less<const void *>()(a.p, b.p) ? -1 : a.p != b.p;
+            break;
+        }
+        if (c)
+            return c;
+
+        // sizes only matter once all elements before them are equal
+        for (; !pending.empty() && !pending.back().a; pending.pop_back()) {
+            if (pending.back().sizes)
+                return pending.back().sizes;
+        }
+        if (pending.empty())
+            return 0;
+        x = pending.back().a;
+        y = pending.back().b;
+        pending.pop_back();
+    }
+}
+
+const tree_node *tree_node::find(const tree_node *t, const atom &key) {
+    while (t) {
+        int c = compareAtoms(key, t->key);
+        if (!c)
+            return t;
+        t = c < 0 ? t->left : t->right;
+    }
+    return nullptr;
+}
+
+const tree_node *tree_node::insert(const tree_node *t, const atom &key,
+                                   const atom &value) {
+    // priorities follow from the keys, equal maps have the same shape
+    return insert(t, key, value, mixBits(atom::hash()(key)));
+}
+
+const tree_node *tree_node::insert(const tree_node *t, const atom &key,
+                                   const atom &value, size_t prio) {
+    if (!t)
+        return make(key, value, nullptr, nullptr, prio);
+
+    int c = compareAtoms(key, t->key);
+    if (!c)
+        return make(t->key, value, t->left, t->right, t->prio);
+
+    if (c < 0) {
+        const tree_node *l = insert(t->left, key, value, prio);
+        if (l->prio <= t->prio)
+            return make(t->key, t->value, l, t->right, t->prio);
+        // rotate the new node up
+        return make(l->key, l->value, l->left,
+                    make(t->key, t->value, l->right, t->right, t->prio),
+                    l->prio);
+    }
+
+    const tree_node *r = insert(t->right, key, value, prio);
+    if (r->prio <= t->prio)
+        return make(t->key, t->value, t->left, r, t->prio);
+    return make(r->key, r->value,
+                make(t->key, t->value, t->left, r->left, t->prio),
+                r->right, r->prio);
+}
+
+const tree_node *tree_node::remove(const tree_node *t, const atom &key) {
+    if (!t)
+        return nullptr;
+
+    int c = compareAtoms(key, t->key);
+    if (!c)
+        return join(t->left, t->right);
+
+    if (c < 0) {
+        const tree_node *l = remove(t->left, key);
+        return l == t->left ? t
+                : make(t->key, t->value, l, t->right, t->prio);
+    }
+
+    const tree_node *r = remove(t->right, key);
+    return r == t->right ? t : make(t->key, t->value, t->left, r, t->prio);
+}
+
+const tree_node *tree_node::join(const tree_node *a, const tree_node *b) {
+    if (!a)
+        return b;
+    if (!b)
+        return a;
+    if (a->prio >= b->prio)
+        return make(a->key, a->value, a->left, join(a->right, b), a->prio);
+    return make(b->key, b->value, join(a, b->left), b->right, b->prio);
+}
+
+void tree_node::inorder(const tree_node *t,
+                        std::vector<const tree_node *> &out) {
+    std::vector<const tree_node *> path;
+    while (t || !path.empty()) {
+        for (; t; t = t->left)
+            path.push_back(t);
+        t = path.back();
+        path.pop_back();
+        out.push_back(t);
+        t = t->right;
+    }
+}
+
+/// (key value) pairs of an ordered map in key order
+list orderedPairs(const tree_node *t) {
+    std::vector<const tree_node *> nodes;
+    tree_node::inorder(t, nodes);
+
+    list::builder out;
+    for (const tree_node *n : nodes) {
+        list::builder pair;
+        pair.push_back(n->key);
+        pair.push_back(n->value);
+        out.push_back(atom(pair.done()));
+    }
+    return out.done();
+}
+
+/* lists, maps and lambdas nest as deep as the data does, so what is still
+   to be written is kept on a stack of pieces instead of the call stack */
+std::string atom::repr() const {
+    struct piece {
+        atom a;
+        const char *text;   ///< written as it is if set, instead of a
+    };
+
+    std::string result;
+    std::vector<piece> pending(1, piece{*this, nullptr});
+    std::vector<atom> items;
+
+    while (!pending.empty()) {
+        piece p = pending.back();
+        pending.pop_back();
+        if (p.text) {
+            result += p.text;
+            continue;
+        }
+
+        const atom &a = p.a;
+        const char *open = nullptr;
+        items.clear();
+        switch (a.t) {
+        case NIL:
+            result += "nil";
+            break;
+        case INT:
+            result += std::to_string(a.iv);
+            break;
+        case FLT:
+            result += realRepr(a.dv);
+            break;
+        case BIG:
+            result += a.asBig().str();
+            break;
+        case SYM:
+            result += a.sy.name();
+            break;
+        case PRC:
+            result += a.bi->special() ? "SPECIAL" : "PROC";
+            break;
+        case FUT:
+            result += "<Future>";
+            break;
+        case MEM:
+            result += "<Memo>";
+            break;
+        case STR:
+            result += a.textRepr();
+            break;
+        case BLD:
+            result += "<StringBuilder>";
+            break;
+        case LMB:
+            result += "<Lambda>";
+            pending.push_back(piece{a.lambda_definition(), nullptr});
+            break;
+        case LST:
+            open = "(";
+            for (const atom &x : a.asList())
+                items.push_back(x);
+            break;
+        case VEC:
+            open = "#(";
+            for (size_t i = 0; i < a.pv->size(); ++i)
+                items.push_back(a.pv->at(i));
+            break;
+        case MAP:
+        case OMP: {
+            open = a.t == MAP ? "#hash(" : "#omap(";
+            for (const atom &x : a.t == MAP ? a.hm->pairs()
+                                            : orderedPairs(a.tn))
+                items.push_back(x);
+            break;
+        }
+        default:
+            result += "<INVALID>";
+            break;
+        }
+
+        if (!open)
+            continue;
+        result += open;
+        pending.push_back(piece{atom(), ")"});
+        for (size_t i = items.size(); i; --i) {
+            pending.push_back(piece{items[i - 1], nullptr});
+            if (i > 1)
+                pending.push_back(piece{atom(), " "});
+        }
+    }
+    return result;
+}
+
+/** translates parsed forms into bytecode. Special forms are recognized by the
+    head symbol and compiled inline, everything else is a call */
+class compiler {
+public:
+    /// bookkeeping needed only while compiling is kept in scratch
+    explicit compiler(arena &scratch)
+        : scratch(scratch), last(nullptr), depth(0)
+    {}
+
+    code *compile(const atom &form) {
+        code *c = heap::instance().make<code>();
+        compileForm(*c, form, true);
+        c->ops.push_back(instr(OP_RETURN));
+        return c;
+    }
+
+private:
+    typedef void (compiler::*special)(code &c, const list &args, bool tail);
+    typedef std::unordered_map<symbol, special, symbol::hash> special_map;
+
+    static const special_map &specials() {
+        static const special_map forms = {
+            {symbol("quote"),  &compiler::compileQuote},
+            {symbol("if"),     &compiler::compileIf},
+            {symbol("lambda"), &compiler::compileLambda},
+            {symbol("define"), &compiler::compileDefine},
+            {symbol("set!"),   &compiler::compileSet},
+            {symbol("setq"),   &compiler::compileSetq},
+            {symbol("defmemo"), &compiler::compileDefmemo},
+            {symbol("profile"), &compiler::compileProfile}
+        };
+        return forms;
+    }
+
+    static uint32_t add(std::vector<atom> &pool, const atom &a) {
+        pool.push_back(a);
+        return pool.size() - 1;
+    }
+
+    static uint32_t add(std::vector<symbol> &pool, const symbol &s) {
+        for (size_t i = 0; i < pool.size(); ++i)
+            if (pool[i] == s)
+                return i;
+        pool.push_back(s);
+        return pool.size() - 1;
+    }
+
+    static uint32_t local(size_t depth, size_t slot) {
+        if (depth > 0xffff || slot > 0xffff)
+            throw std::invalid_argument("Too many nested local variables");
+        return depth << 16 | slot;
+    }
+
+    /// finds the frame address of a local variable, false for globals
+    bool resolve(const symbol &name, uint32_t &addr) const {
+        for (size_t depth = 0; depth < scopes.size(); ++depth) {
+            const scope &vars = scopes[scopes.size() - 1 - depth];
+            for (size_t slot = 0; slot < vars.size(); ++slot) {
+                if (vars[slot] == name) {
+                    addr = local(depth, slot);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    /// tail is set when the value of form is what the code returns
+    void compileForm(code &c, const atom &form, bool tail = false) {
+        uint32_t addr;
+        switch (form.type()) {
+        case atom::SYM:
+            if (resolve(form.asSymbol(), addr))
+                c.ops.push_back(instr(OP_LOCAL, addr));
+            else
+                c.ops.push_back(
+                        instr(OP_GLOBAL, add(c.names, form.asSymbol())));
+            return;
+        case atom::LST:
+            break;
+        default:
+            c.ops.push_back(instr(OP_CONST, add(c.consts, form)));
+            return;
+        }
+
+        const list &lst = form.asList();
+
+        // empty list evaluates to itself
+        if (lst.empty()) {
+            c.ops.push_back(instr(OP_CONST, add(c.consts, form)));
+            return;
+        }
+
+        nesting guard(depth);
+
+        const atom &head = lst.front();
+        if (head.type() == atom::SYM) {
+            special_map::const_iterator i = specials().find(head.asSymbol());
+            if (i != specials().end()) {
+                (this->*(i->second))(c, lst.rest(), tail);
+                return;
+            }
+        }
+
+        compileForm(c, head);
+
+        uint32_t argc = 0;
+        for (const atom &a : lst.rest()) {
+            compileForm(c, a);
+            ++argc;
+        }
+
+        c.ops.push_back(instr(tail ? OP_TAIL_CALL : OP_CALL, argc));
+    }
+
+    void compileQuote(code &c, const list &args, bool) {
+        c.ops.push_back(instr(OP_CONST, add(c.consts, args.front())));
+    }
+
+    void compileIf(code &c, const list &args, bool tail) {
+        compileForm(c, args[0]);
+        size_t jelse = c.ops.size();
+        c.ops.push_back(instr(OP_JUMP_IF_FALSE));
+        compileForm(c, args[1], tail);
+        size_t jend = c.ops.size();
+        c.ops.push_back(instr(OP_JUMP));
+        c.ops[jelse].arg = c.ops.size();
+        compileForm(c, args[2], tail);
+        c.ops[jend].arg = c.ops.size();
+    }
+
+    void compileLambda(code &c, const list &args, bool) {
+        if (args.size() != 2)
+            throw std::invalid_argument(
+                    "Lambda definition needs two list params");
+
+        if (args[0].type() != atom::LST)
+            throw std::invalid_argument(
+                    "Lambda definition's first arg has to be list of args");
+
+        code *body = heap::instance().make<code>();
+        body->definition = atom(args);
+        for (const atom &p : args[0].asList())
+            body->params.push_back(p.asSymbol());
+
+        scopes.push_back(scope(body->params.begin(), body->params.end(),
+                               arena_allocator<symbol>(scratch)));
+        compileForm(*body, args[1], true);
+        body->ops.push_back(instr(OP_RETURN));
+        body->slots = scopes.back().size();
+        scopes.pop_back();
+        last = body;
+
+        c.ops.push_back(instr(OP_LAMBDA, add(c.consts, atom::lambda(body))));
+        c.captures = true;
+    }
+
+    /// define inside a lambda body creates a new slot in its frame
+    void compileDefine(code &c, const list &args, bool) {
+        const symbol &name = args[0].asSymbol();
+        compileForm(c, args[1]);
+        if (c.ops.back().op == OP_LAMBDA)
+            last->name = name;
+
+        if (scopes.empty()) {
+            c.ops.push_back(instr(OP_SET_GLOBAL, add(c.names, name)));
+            return;
+        }
+
+        scope &vars = scopes.back();
+        size_t slot = 0;
+        while (slot < vars.size() && vars[slot] != name)
+            ++slot;
+        if (slot == vars.size())
+            vars.push_back(name);
+
+        c.ops.push_back(instr(OP_SET_LOCAL, local(0, slot)));
+    }
+
+    /// (defmemo name (args) body) is (define name (memoize (lambda ...)))
+    void compileDefmemo(code &c, const list &args, bool) {
+        if (args.size() != 3)
+            throw std::invalid_argument(
+                    "Memoized definition needs a name, args and a body");
+
+        list::builder fn;
+        fn.push_back(atom("lambda"));
+        fn.push_back(args[1]);
+        fn.push_back(args[2]);
+
+        list::builder memoized;
+        memoized.push_back(atom("memoize"));
+        memoized.push_back(atom(fn.done()));
+
+        list::builder def;
+        def.push_back(args[0]);
+        def.push_back(atom(memoized.done()));
+        compileDefine(c, def.done(), false);
+        last->name = args[0].asSymbol();
+    }
+
+    /// (profile expr [path]) is (profile-call (lambda () expr) [path])
+    void compileProfile(code &c, const list &args, bool tail) {
+        if (args.empty() || args.size() > 2)
+            throw std::invalid_argument(
+                    "Profile needs an expression and optionally a path");
+
+        list::builder fn;
+        fn.push_back(atom("lambda"));
+        fn.push_back(atom(list()));
+        fn.push_back(args[0]);
+
+        list::builder call;
+        call.push_back(atom("profile-call"));
+        call.push_back(atom(fn.done()));
+        if (args.size() > 1)
+            call.push_back(args[1]);
+        compileForm(c, atom(call.done()), tail);
+        last->name = symbol("profile");
+    }
+
+    void compileSet(code &c, const list &args, bool) {
+        compileForm(c, args[1]);
+        compileStore(c, args[0].asSymbol());
+    }
+
+    void compileSetq(code &c, const list &args, bool) {
+        c.ops.push_back(instr(OP_CONST, add(c.consts, args[1])));
+        compileStore(c, args[0].asSymbol());
+    }
+
+    void compileStore(code &c, const symbol &name) {
+        uint32_t addr;
+        if (resolve(name, addr))
+            c.ops.push_back(instr(OP_SET_LOCAL, addr));
+        else
+            c.ops.push_back(instr(OP_SET_GLOBAL, add(c.names, name)));
+    }
+
+    typedef std::vector<symbol, arena_allocator<symbol>> scope;
+
+    /** counts the forms being compiled. They nest on the C++ stack, so
+        expressions nested deeper than any program needs are refused before
+        they can overflow it. Quoted data is not compiled and has no limit */
+    struct nesting {
+        static const size_t max_depth = 1000;
+
+        explicit nesting(size_t &depth) : depth(depth) {
+            if (++depth > max_depth) {
+                --depth;
+                throw std::invalid_argument("Expression nested too deeply");
+            }
+        }
+
+        ~nesting() {
+            --depth;
+        }
+
+        size_t &depth;
+    };
+
+    arena &scratch;
+
+    // body of the lambda compiled last
+    code *last;
+
+    size_t depth;
+
+    // variables of the lambdas being compiled, innermost last
+    std::vector<scope> scopes;
+};
+
+/** call profiler. While it runs, the VM reports every call of a lambda or
+    a builtin and every return from one. Each thread keeps its own stack of
+    active calls and its own call tree; time between entering and leaving a
+    function counts as exclusive time of that function minus what its
+    callees took, and as inclusive time of its outermost activation. Each
+    node of the call trees collects the exclusive time of its path, so the
+    trees are written out as collapsed stacks, "outer;inner;innermost ns"
+    per line, which flamegraph tools read */
+class profiler {
+public:
+    static profiler &instance() {
+        static profiler *p = new profiler();
+        return *p;
+    }
+
+    /// cheap enough to check on every call
+    static bool running() {
+        return on.load(std::memory_order_relaxed);
+    }
+
+    /// drops what was recorded so far and starts recording
+    void start() {
+        std::lock_guard<std::mutex> guard(lock);
+        for (thread_data *t : threads) {
+            std::lock_guard<std::mutex> thread_guard(t->lock);
+            t->reset();
+        }
+        on.store(true, std::memory_order_relaxed);
+    }
+
+    void stop() {
+        on.store(false, std::memory_order_relaxed);
+    }
+
+    void enter(const code &c) {
+        enter(&c, [](const void *key) {
+            const code &c = *static_cast<const code *>(key);
+            if (!c.name.null())
+                return c.name.name();
+            return "lambda" + c.definition[0].repr();
+        });
+    }
+
+    void enter(const builtin &b) {
+        enter(&b, [](const void *key) {
+            return std::string(static_cast<const builtin *>(key)->name);
+        });
+    }
+
+    /// the function entered last on this thread returns
+    void leave() {
+        thread_data &t = local();
+        std::lock_guard<std::mutex> guard(t.lock);
+        if (t.stack.empty())
+            return;     // entered before recording started
+
+        active a = t.stack.back();
+        t.stack.pop_back();
+        uint64_t total = now() - a.start;
+        uint64_t self = total > a.callees ? total - a.callees : 0;
+
+        node &n = t.nodes[a.node];
+        function &f = t.functions[n.fn];
+        n.self += self;
+        f.exclusive += self;
+        if (--f.active == 0)
+            f.inclusive += total;
+        if (!t.stack.empty())
+            t.stack.back().callees += total;
+    }
+
+    /// enters a function on construction and leaves it when destroyed
+    class scope {
+    public:
+        template <class F>
+        explicit scope(const F &f) : entered(running()) {
+            if (entered)
+                instance().enter(f);
+        }
+
+        ~scope() {
+            if (entered)
+                instance().leave();
+        }
+
+    private:
+        bool entered;
+    };
+
+    /** writes calls, inclusive and exclusive milliseconds of every function
+        called, the most expensive ones by exclusive time first */
+    void report(std::ostream &out) {
+        struct row {
+            std::string name;
+            function totals;
+        };
+        std::vector<row> rows;
+        std::unordered_map<std::string, size_t> index;
+
+        std::lock_guard<std::mutex> guard(lock);
+        for (thread_data *t : threads) {
+            std::lock_guard<std::mutex> thread_guard(t->lock);
+            for (const function &f : t->functions) {
+                std::unordered_map<std::string, size_t>::iterator i
+                        = index.find(f.name);
+                if (i == index.end()) {
+                    i = index.insert(std::make_pair(f.name, rows.size())).first;
+                    rows.push_back(row{f.name, function()});
+                }
+                function &r = rows[i->second].totals;
+                r.calls += f.calls;
+                r.inclusive += f.inclusive;
+                r.exclusive += f.exclusive;
+            }
+        }
+
+        std::sort(rows.begin(), rows.end(), [](const row &a, const row &b) {
+            return a.totals.exclusive > b.totals.exclusive;
+        });
+
+        char line[128];
+        std::snprintf(line, sizeof(line), "%12s %14s %14s  %s\n", "calls",
+                      "inclusive ms", "exclusive ms", "function");
+        out << line;
+        for (const row &r : rows) {
+            std::snprintf(line, sizeof(line), "%12llu %14.3f %14.3f  ",
+                          static_cast<unsigned long long>(r.totals.calls),
+                          r.totals.inclusive / 1e6, r.totals.exclusive / 1e6);
+            out << line << r.name << '\n';
+        }
+    }
+
+    /// writes the recorded stacks of all threads in collapsed form
+    void collapsed(const std::string &path) {
+        std::ofstream out(path.c_str());
+        if (!out)
+            throw std::invalid_argument("Cannot write " + path);
+        collapsed(out);
+    }
+
+    void collapsed(std::ostream &out) {
+        std::lock_guard<std::mutex> guard(lock);
+        for (thread_data *t : threads) {
+            std::lock_guard<std::mutex> thread_guard(t->lock);
+            std::vector<std::string> paths(t->nodes.size());
+            // parents are always made before their children
+            for (size_t i = 1; i < t->nodes.size(); ++i) {
+                const node &n = t->nodes[i];
+                const std::string &name = t->functions[n.fn].name;
+                paths[i] = n.parent ? paths[n.parent] + ";" + name : name;
+                if (n.self)
+                    out << paths[i] << ' ' << n.self << '\n';
+            }
+        }
+    }
+
+private:
+    typedef std::string (*describer)(const void *key);
+
+    struct function {
+        std::string name;
+        uint64_t calls = 0;
+        uint64_t inclusive = 0;     ///< ns
+        uint64_t exclusive = 0;     ///< ns
+        size_t active = 0;          ///< activations on the stack
+    };
+
+    /// a path in the call tree, node 0 is the root
+    struct node {
+        size_t fn;
+        size_t parent;
+        uint64_t self;
+        std::unordered_map<size_t, size_t> children;
+    };
+
+    struct active {
+        size_t node;
+        uint64_t start;
+        uint64_t callees;
+    };
+
+    struct thread_data {
+        thread_data() {
+            reset();
+        }
+
+        void reset() {
+            functions.clear();
+            ids.clear();
+            stack.clear();
+            nodes.assign(1, node{0, 0, 0, {}});
+        }
+
+        std::mutex lock;
+        std::vector<function> functions;
+        std::unordered_map<const void *, size_t> ids;
+        std::vector<node> nodes;
+        std::vector<active> stack;
+    };
+
+    profiler() {}
+
+    static uint64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    /// data of the calling thread, registered on first use and kept
+    thread_data &local() {
+        static thread_local thread_data *t = nullptr;
+        if (!t) {
+            t = new thread_data();
+            std::lock_guard<std::mutex> guard(lock);
+            threads.push_back(t);
+        }
+        return *t;
+    }
+
+    /// key identifies the function, describe names it when first seen
+    void enter(const void *key, describer describe) {
+        thread_data &t = local();
+        std::lock_guard<std::mutex> guard(t.lock);
+
+        std::unordered_map<const void *, size_t>::iterator i
+                = t.ids.find(key);
+        if (i == t.ids.end()) {
+            i = t.ids.insert(std::make_pair(key, t.functions.size())).first;
+            t.functions.push_back(function());
+            t.functions.back().name = describe(key);
+        }
+        size_t fn = i->second;
+
+        size_t parent = t.stack.empty() ? 0 : t.stack.back().node;
+        std::unordered_map<size_t, size_t>::iterator child
+                = t.nodes[parent].children.find(fn);
+        size_t n;
+        if (child != t.nodes[parent].children.end()) {
+            n = child->second;
+        } else {
+            n = t.nodes.size();
+            t.nodes[parent].children[fn] = n;
+            t.nodes.push_back(node{fn, parent, 0, {}});
+        }
+
+        ++t.functions[fn].calls;
+        ++t.functions[fn].active;
+        t.stack.push_back(active{n, now(), 0});
+    }
+
+    static std::atomic<bool> on;
+    std::mutex lock;
+    std::vector<thread_data *> threads;
+};
+
+std::atomic<bool> profiler::on(false);
+
+/** stack machine executing compiled code. Arguments and temporaries of all
+    active calls share one value stack. Calls between lambdas do not recurse
+    on the C++ stack, they push a record onto the VM's own call stack, and
+    calls in tail position replace the current record instead, so tail
+    recursion runs in constant space. The value stack and the call records
+    are a root set of the garbage collector */
+class vm : public root_set {
+public:
+    /// every thread runs its own machine
+    static vm &instance() {
+        static thread_local vm machine;
+        return machine;
+    }
+
+    vm() {
+        heap::instance().add_root(this);
+    }
+
+    ~vm() {
+        heap::instance().remove_root(this);
+    }
+
+    /** runs entry to its end. If profiled, the caller entered it in the
+        profiler and the call record leaves it again, on return or when a
+        tail call replaces it */
+    atom run(const code &entry, frame *entry_fr, environment &entry_env,
+             bool profiled = false) {
+        heap::mutator running;
+        unwind guard(*this);
+        calls.push_back(call(&entry, entry_fr, &entry_env, stack.size()));
+        calls.back().profiled = profiled;
+
+        const code *c = &entry;
+        const instr *pc = c->ops.data();
+        frame *fr = entry_fr;
+        environment *env = &entry_env;
+
+        heap::instance().safepoint();
+
+        for (;;) {
+            const instr &i = *pc++;
+            switch (i.op) {
+            case OP_CONST:
+                stack.push_back(c->consts[i.arg]);
+                break;
+            case OP_GLOBAL:
+                stack.push_back(env->get(c->names[i.arg]));
+                break;
+            case OP_SET_GLOBAL:
+                env->define(c->names[i.arg], stack.back());
+                break;
+            case OP_LOCAL:
+                stack.push_back(fr->at(i.arg >> 16, i.arg & 0xffff));
+                break;
+            case OP_SET_LOCAL:
+                fr->at(i.arg >> 16, i.arg & 0xffff) = stack.back();
+                break;
+            case OP_POP:
+                stack.pop_back();
+                break;
+            case OP_JUMP:
+                pc = c->ops.data() + i.arg;
+                break;
+            case OP_JUMP_IF_FALSE: {
+                bool jump = stack.back().type() == atom::NIL;
+                stack.pop_back();
+                if (jump)
+                    pc = c->ops.data() + i.arg;
+                break;
+            }
+            case OP_LAMBDA:
+                stack.push_back(c->consts[i.arg].bind(fr, *env));
+                break;
+            case OP_CALL:
+            case OP_TAIL_CALL: {
+                heap::instance().safepoint();
+
+                size_t fn = stack.size() - i.arg - 1;
+                const atom &f = stack[fn];
+
+                /* memoized lambdas run here too instead of recursing through
+                   apply(). The memo and its arguments stay on the stack
+                   below a copy of them the lambda is called with, and the
+                   result is stored once the call returns */
+                size_t memoized = none;
+                if (f.type() == atom::MEM && f.mm->fn.type() == atom::LMB) {
+                    atom value;
+                    if (f.mm->find(stack.data() + fn + 1, i.arg, value)) {
+                        stack.resize(fn);
+                        stack.push_back(std::move(value));
+                        break;
+                    }
+
+                    memoized = fn;
+                    fn = stack.size();
+                    stack.push_back(stack[memoized].mm->fn);
+                    for (size_t k = 0; k < i.arg; ++k)
+                        stack.push_back(stack[memoized + 1 + k]);
+                } else if (f.type() != atom::LMB) {
+                    atom result = apply(fn, *env, i.arg);
+                    stack.resize(fn);
+                    stack.push_back(std::move(result));
+                    break;
+                }
+
+                closure *cl = stack[fn].cl;
+                frame *callee = activate(fn, i.arg);
+
+                if (i.op == OP_TAIL_CALL && memoized == none) {
+                    // the callee returns straight to our caller, and stores
+                    // the result in place of us if we were memoized
+                    if (calls.back().profiled)
+                        profiler::instance().leave();
+                    release(calls.back());
+                    size_t memo = calls.back().memo;
+                    calls.back() = call(cl->body, callee, cl->env->env,
+                                        calls.back().base);
+                    calls.back().memo = memo;
+                    stack.resize(calls.back().base);
+                } else {
+                    calls.back().pc = pc;
+                    calls.push_back(call(cl->body, callee, cl->env->env,
+                                         fn));
+                    calls.back().memo = memoized;
+                    stack.resize(fn);
+                }
+
+                if (profiler::running()) {
+                    profiler::instance().enter(*cl->body);
+                    calls.back().profiled = true;
+                }
+
+                c = cl->body;
+                pc = c->ops.data();
+                fr = callee;
+                env = cl->env->env;
+                break;
+            }
+            case OP_RETURN: {
+                if (calls.back().profiled)
+                    profiler::instance().leave();
+                atom result(std::move(stack.back()));
+                stack.resize(calls.back().base);
+                size_t memoized = calls.back().memo;
+                if (memoized != none) {
+                    stack[memoized].mm->insert(stack.data() + memoized + 1,
+                                               stack.size() - memoized - 1,
+                                               result);
+                    stack.resize(memoized);
+                }
+                release(calls.back());
+                calls.pop_back();
+
+                if (calls.size() == guard.depth)
+                    return result;
+
+                const call &caller = calls.back();
+                c = caller.c;
+                pc = caller.pc;
+                fr = caller.fr;
+                env = caller.env;
+                stack.push_back(std::move(result));
+                break;
+            }
+            }
+        }
+    }
+
+    /** calls the function at stack index fn with the argc values above it.
+        Function and arguments stay on the stack during the call, so the
+        collector keeps seeing them */
+    atom apply(size_t fn, environment &env, size_t argc) {
+        const atom &f = stack[fn];
+        switch (f.type()) {
+        case atom::PRC: {
+            profiler::scope profiled(*f.bi);
+            return f.bi->call(env, stack.data() + fn + 1, argc);
+        }
+        case atom::LMB: {
+            closure *cl = f.cl;
+            frame *callee = activate(fn, argc);
+            bool profiled = profiler::running();
+            if (profiled)
+                profiler::instance().enter(*cl->body);
+            return run(*cl->body, callee, *cl->env->env, profiled);
+        }
+        case atom::MEM: {
+            memo *m = f.mm;
+            atom value;
+            if (m->find(stack.data() + fn + 1, argc, value))
+                return value;
+
+            // the memo and its arguments stay where they are meanwhile
+            size_t callee = stack.size();
+            stack.push_back(m->fn);
+            for (size_t i = 0; i < argc; ++i)
+                stack.push_back(stack[fn + 1 + i]);
+            value = apply(callee, env, argc);
+            m->insert(stack.data() + fn + 1, argc, value);
+            stack.resize(callee);
+            return value;
+        }
+        default:
+            throw std::invalid_argument(
+                    "Could not eval " + f.repr());
+        }
+    }
+
+    /** calls f with argc arguments, which are copied onto the stack first
+        and so must not point into it */
+    atom invoke(const atom &f, environment &env, const atom *args,
+                size_t argc) {
+        heap::mutator running;
+        unwind guard(*this);
+        size_t fn = stack.size();
+        stack.push_back(f);
+        stack.insert(stack.end(), args, args + argc);
+        return apply(fn, env, argc);
+    }
+
+    void trace(heap &h) const {
+        for (const atom &a : stack)
+            h.mark(a);
+        for (const call &cl : calls) {
+            h.mark(cl.c);
+            h.mark(cl.fr);
+        }
+        for (const frame *f : spare)
+            h.mark(f);
+    }
+
+    std::vector<atom> stack;
+
+private:
+    /** sets up a frame for a call of the lambda at stack index fn and moves
+        the arguments on the stack into it. Every call gets its own frame, so
+        recursive calls cannot clobber each other. Frames of finished calls
+        are reused when possible, see release() */
+    frame *activate(size_t fn, size_t argc) {
+        const closure *cl = stack[fn].cl;
+        if (!cl->env)
+            throw std::invalid_argument(
+                    "Lambda is missing environment");
+        if (!cl->env->env)
+            throw std::invalid_argument(
+                    "Environment of lambda no longer exists");
+
+        const code &c = *cl->body;
+        if (argc < c.params.size())
+            throw std::invalid_argument(
+                    "Lambda call with incomplete arguments");
+
+        frame *callee;
+        if (spare.empty()) {
+            heap &h = heap::instance();
+            callee = h.make<frame>(c.slots, cl->outer);
+            h.account(c.slots * sizeof(atom));
+        } else {
+            callee = spare.back();
+            spare.pop_back();
+            callee->slots.resize(c.slots);
+            callee->outer = cl->outer;
+        }
+
+        for (size_t i = 0; i < c.params.size(); ++i)
+            callee->slots[i] = std::move(stack[fn + 1 + i]);
+
+        return callee;
+    }
+
+    static const size_t none = ~size_t(0);
+
+    /// a lambda call in progress, base is where its part of the stack starts
+    struct call {
+        call(const code *c, frame *fr, environment *env, size_t base)
+            : c(c), pc(nullptr), fr(fr), env(env), base(base), memo(none),
+              profiled(false)
+        {}
+
+        const code *c;
+        const instr *pc;   ///< return address, saved while calling out
+        frame *fr;
+        environment *env;
+        size_t base;
+        size_t memo;       ///< stack index of the memo to store the result in
+        bool profiled;     ///< entered in the profiler, has to leave it
+    };
+
+    /** keeps the frame of a finished call for reuse. Only code creating no
+        closures is sure to leave no references to its frame behind, other
+        frames are left to the collector */
+    void release(const call &done) {
+        if (!done.fr || done.c->captures || spare.size() >= max_spare)
+            return;
+
+        done.fr->slots.clear();
+        done.fr->outer = nullptr;
+        spare.push_back(done.fr);
+    }
+
+    // drops the calls and stack entries of a run, also when it throws
+    struct unwind {
+        unwind(vm &m) : m(m), depth(m.calls.size()), base(m.stack.size()) {}
+
+        ~unwind() {
+            for (size_t i = m.calls.size(); i > depth; --i) {
+                if (m.calls[i - 1].profiled)
+                    profiler::instance().leave();
+            }
+            m.calls.erase(m.calls.begin() + depth, m.calls.end());
+            m.stack.resize(base);
+        }
+
+        vm &m;
+        size_t depth;
+        size_t base;
+    };
+
+    std::vector<call> calls;
+
+    // frames ready for reuse, a stack so the most recently used come first
+    static const size_t max_spare = 1024;
+    std::vector<frame *> spare;
+};
+
+const size_t vm::none;
+
+atom atom::eval(environment &env) const {
+    heap::mutator running;
+    arena scratch;
+    compiler comp(scratch);
+    return vm::instance().run(*comp.compile(*this), nullptr, env);
+}
+
+atom atom::operator()(environment &env, const atom &values) {
+    heap::mutator running;
+    vm &machine = vm::instance();
+    size_t fn = machine.stack.size();
+
+    machine.stack.push_back(*this);
+    for (const atom &v : values.asList())
+        machine.stack.push_back(v);
+
+    atom result = machine.apply(fn, env, machine.stack.size() - fn - 1);
+    machine.stack.resize(fn);
+    return result;
+}
+
+void task::run() {
+    heap::mutator running;
+    vm &machine = vm::instance();
+    try {
+        if (!env->env)
+            throw std::invalid_argument(
+                    "Environment of task no longer exists");
+        environment &globals = *env->env;
+
+        switch (k) {
+        case CALL:
+            result = machine.invoke(fn, globals, args.data(), args.size());
+            break;
+        case MAP: {
+            list::builder out;
+            for (const atom &a : args)
+                out.push_back(machine.invoke(fn, globals, &a, 1));
+            result = atom(out.done());
+            break;
+        }
+        case REDUCE: {
+            atom acc = args[0];
+            for (size_t i = 1; i < args.size(); ++i) {
+                const atom pair[] = {acc, args[i]};
+                acc = machine.invoke(fn, globals, pair, 2);
+            }
+            result = acc;
+            break;
+        }
+        }
+    } catch (const std::exception &e) {
+        error = e.what();
+        failed = true;
+    }
+
+    args.clear();
+    heap::instance().end_task();
+    done.store(true, std::memory_order_release);
+}
+
+/** work stealing thread pool. Every worker has a deque of tasks, it takes
+    its newest task from the back while idle workers steal the oldest ones
+    from the front. Threads other than the workers submit to a shared queue.
+    A thread waiting for a task runs queued tasks in the meantime, so nested
+    futures cannot starve the pool. Workers start on first use, one less
+    than there are cores (or LISPY_THREADS) as the waiting thread helps */
+class scheduler {
+public:
+    // never destroyed - workers keep running until the process exits
+    static scheduler &instance() {
+        static scheduler *s = new scheduler();
+        return *s;
+    }
+
+    /// threads running tasks, counting the one waiting for them
+    size_t threads() const {
+        return workers.size() + 1;
+    }
+
+    void submit(task *t) {
+        heap::instance().begin_task();
+
+        queue &q = self() >= 0 ? *queues[self()] : *queues.back();
+        {
+            std::lock_guard<std::mutex> guard(q.lock);
+            q.tasks.push_back(t);
+        }
+        queued.fetch_add(1, std::memory_order_acq_rel);
+        wake();
+    }
+
+    /// returns once t is done, running queued tasks meanwhile
+    void wait(const task *t) {
+        while (!t->done.load(std::memory_order_acquire)) {
+            if (task *next = find()) {
+                execute(next);
+                continue;
+            }
+
+            std::unique_lock<std::mutex> l(idle_lock);
+            idle.wait(l, [this, t] {
+                return t->done.load(std::memory_order_acquire)
+                        || queued.load(std::memory_order_acquire);
+            });
+        }
+    }
+
+private:
+    struct queue {
+        std::mutex lock;
+        std::deque<task *> tasks;
+    };
+
+    scheduler() : queued(0) {
+        size_t n = std::thread::hardware_concurrency();
+        if (const char *env = ::getenv("LISPY_THREADS"))
+            n = std::strtoul(env, nullptr, 10);
+        n = std::max<size_t>(n, 2) - 1;
+
+        // the last queue is shared by threads which are no workers
+        for (size_t i = 0; i <= n; ++i)
+            queues.emplace_back(new queue());
+        for (size_t i = 0; i < n; ++i)
+            workers.emplace_back(&scheduler::work, this, i);
+    }
+
+    /// index of the calling worker's queue, -1 for other threads
+    static int &self() {
+        static thread_local int index = -1;
+        return index;
+    }
+
+    void work(size_t index) {
+        self() = static_cast<int>(index);
+        for (;;) {
+            if (task *t = find()) {
+                execute(t);
+                continue;
+            }
+
+            std::unique_lock<std::mutex> l(idle_lock);
+            idle.wait(l, [this] {
+                return queued.load(std::memory_order_acquire) != 0;
+            });
+        }
+    }
+
+    /// the own newest task, or the oldest one of another queue
+    task *find() {
+        if (!queued.load(std::memory_order_acquire))
+            return nullptr;
+
+        int me = self();
+        if (me >= 0) {
+            if (task *t = take(*queues[me], true))
+                return t;
+        }
+
+        size_t n = queues.size();
+        size_t first = me >= 0 ? me + 1 : 0;
+        for (size_t i = 0; i < n; ++i) {
+            if (task *t = take(*queues[(first + i) % n], false))
+                return t;
+        }
+        return nullptr;
+    }
+
+    task *take(queue &q, bool newest) {
+        std::lock_guard<std::mutex> guard(q.lock);
+        if (q.tasks.empty())
+            return nullptr;
+
+        task *t;
+        if (newest) {
+            t = q.tasks.back();
+            q.tasks.pop_back();
+        } else {
+            t = q.tasks.front();
+            q.tasks.pop_front();
+        }
+        queued.fetch_sub(1, std::memory_order_acq_rel);
+        return t;
+    }
+
+    void execute(task *t) {
+        t->run();
+        wake();
+    }
+
+    void wake() {
+        // taking the lock orders the change before any waiter's check
+        { std::lock_guard<std::mutex> guard(idle_lock); }
+        idle.notify_all();
+    }
+
+    std::vector<std::unique_ptr<queue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<size_t> queued;
+    std::mutex idle_lock;
+    std::condition_variable idle;
+};
+
+/// waits for a future and returns its value, other values are returned as is
+atom touch(const atom &f) {
+    if (f.type() != atom::FUT)
+        return f;
+
+    const task &t = f.asTask();
+    scheduler::instance().wait(&t);
+    if (t.failed)
+        throw std::invalid_argument(t.error);
+    return t.result;
+}
+
+/** splits the elements of l into tasks of kind k over fn, a few for every
+    thread so that uneven chunks balance out, and waits for all of them */
+std::vector<task *> parallel(task::kind k, const atom &fn, const atom &l,
+                             environment &env) {
+    std::vector<atom> items;
+    if (l.type() != atom::NIL) {
+        for (const atom &e : l.asList())
+            items.push_back(e);
+    }
+
+    scheduler &s = scheduler::instance();
+    size_t parts = std::min(items.size(), s.threads() * 4);
+    std::vector<task *> tasks;
+    if (!parts)
+        return tasks;
+
+    heap &h = heap::instance();
+    size_t per = (items.size() + parts - 1) / parts;
+    for (size_t i = 0; i < items.size(); i += per) {
+        size_t end = std::min(items.size(), i + per);
+        task *t = h.make<task>(k, fn, env);
+        t->args.assign(items.begin() + i, items.begin() + end);
+        h.account(t->args.capacity() * sizeof(atom));
+        tasks.push_back(t);
+    }
+
+    // nothing is collected before the last of them is done
+    for (task *t : tasks)
+        s.submit(t);
+    for (task *t : tasks)
+        s.wait(t);
+
+    for (task *t : tasks) {
+        if (t->failed)
+            throw std::invalid_argument(t->error);
+    }
+    return tasks;
+}
+
+atom build_from(tokenizer &t) {
+    // nill
+    if (!t.has_next())
+        return atom();
+
+    // lists being read are kept on a stack of their own rather than the C++
+    // one, so no amount of nesting can overflow it
+    std::vector<list::builder> open;
+    for (;;) {
+        str_view tok = t.next();
+        if (tok == "(")
+            open.push_back(list::builder());
+        else if (open.empty())
+            return atom(tok);
+        else
+            open.back().push_back(atom(tok));
+
+        // lists end at their closing brace, or all of them with the input
+        while (!open.empty() && (!t.has_next() || t.peek_next() == ")")) {
+            if (t.has_next())
+                t.next();
+            atom lst(open.back().done());
+            open.pop_back();
+            if (open.empty())
+                return lst;
+            open.back().push_back(lst);
+        }
+    }
+}
+
+/** reads top level forms from a file descriptor one at a time. Regular
+    files are memory mapped and parsed in place, anything else (pipes,
+    terminals) is read in chunks into a buffer that holds little more than
+    the form being parsed. Either way, memory use is bounded by the largest
+    form rather than by the size of the input */
+class reader {
+public:
+    /// reads from fd, which stays owned by the caller
+    explicit reader(int fd) : fd(fd), owned(false) {
+        init();
+    }
+
+    /// opens the file at path, throws if that fails
+    explicit reader(const std::string &path)
+        : fd(::open(path.c_str(), O_RDONLY)), owned(true)
+    {
+        if (fd < 0)
+            throw std::invalid_argument("Cannot open " + path);
+        init();
+    }
+
+    reader(const reader &) = delete;
+    reader &operator=(const reader &) = delete;
+
+    ~reader() {
+        if (map)
+            ::munmap(const_cast<char *>(map), map_size);
+        if (owned)
+            ::close(fd);
+    }
+
+    /// parses the next form into form, returns false once the input ends
+    bool next(atom &form) {
+        if (map) {
+            heap::mutator running;
+            tokenizer t(str_view(pos, map + map_size));
+            if (!t.has_next())
+                return false;
+
+            form = build_from(t);
+            pos = t.si;
+            return true;
+        }
+
+        const char *end;
+        while (!(end = formEnd())) {
+            if (!fill())
+                break;
+        }
+
+        // not while filling, reads may block
+        heap::mutator running;
+        str_view sv(buf.data() + start, end ? end : buf.data() + buf.size());
+        tokenizer t(sv);
+        if (!t.has_next())
+            return false;
+
+        form = build_from(t);
+        start = t.si - buf.data();
+        return true;
+    }
+
+private:
+    static const size_t chunk = 64 * 1024;
+
+    void init() {
+        map = nullptr;
+        map_size = 0;
+        pos = nullptr;
+        start = 0;
+        eof = false;
+
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+            return;
+
+        void *p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED)
+            return;
+
+        // pages are read once front to back, the kernel may drop them early
+        ::madvise(p, st.st_size, MADV_SEQUENTIAL);
+        map = static_cast<const char *>(p);
+        map_size = st.st_size;
+        pos = map;
+    }
+
+    /** finds where the first form in the buffer ends. Returns nullptr
+        when the form may continue past the data read so far */
+    const char *formEnd() const {
+        const char *p = buf.data() + start;
+        const char *e = buf.data() + buf.size();
+        int depth = 0;
+
+        while (p != e) {
+            if (*p == ';') {
+                while (p != e && *p != '\n')
+                    ++p;
+            } else if (::isspace(*p)) {
+                ++p;
+            } else if (*p == '(') {
+                ++depth;
+                ++p;
+            } else if (*p == ')') {
+                ++p;
+                if (--depth <= 0)
+                    return p;
+            } else if (*p == '"') {
+                if (!tokenizer::skipString(p, e) && !eof)
+                    return nullptr;
+                if (depth == 0)
+                    return p;
+            } else {
+                while (p != e && !::isspace(*p) && *p != '(' && *p != ')'
+                       && *p != ';' && *p != '"')
+                    ++p;
+                // a token at top level is a form of its own
+                if (depth == 0 && (p != e || eof))
+                    return p;
+            }
+        }
+
+        return nullptr;
+    }
+
+    /** appends more input to the buffer, dropping what was parsed already.
+        Returns false at the end of input */
+    bool fill() {
+        if (eof)
+            return false;
+
+        buf.erase(0, start);
+        start = 0;
+
+        // reads grow with the buffer, so scanning a huge form stays linear
+        size_t want = std::max(chunk, buf.size());
+        size_t have = buf.size();
+        buf.resize(have + want);
+
+        ssize_t got;
+        do {
+            got = ::read(fd, &buf[have], want);
+        } while (got < 0 && errno == EINTR);
+
+        if (got < 0) {
+            buf.resize(have);
+            throw std::invalid_argument(std::string("Read failed: ")
+                                        + std::strerror(errno));
+        }
+
+        buf.resize(have + got);
+        if (got == 0)
+            eof = true;
+        return true;
+    }
+
+    int fd;
+    bool owned;
+
+    // memory mapped input
+    const char *map;
+    size_t map_size;
+    const char *pos;
+
+    // buffered input, parsing continues at start
+    std::string buf;
+    size_t start;
+    bool eof;
+};
+
+const size_t reader::chunk;
+
+/** evaluates forms from r one at a time, returns the value of the last one.
+    Each form is dropped once evaluated, so arbitrarily long inputs can be
+    processed */
+atom exec(environment &env, reader &r) {
+    atom result, form;
+    // reading may block, other threads collect meanwhile
+    gc_root keep_result(result), keep_form(form);
+
+    while (r.next(form)) {
+        heap::mutator running;
+        // compiler bookkeeping is per form, long inputs must not accumulate it
+        arena scratch;
+        compiler comp(scratch);
+        result = vm::instance().run(*comp.compile(form), nullptr, env);
+    }
+
+    return result;
+}
+
+/// evaluates the file at path, see exec(environment &, reader &)
+atom load(environment &env, const std::string &path) {
+    reader r(path);
+    return exec(env, r);
+}
+
+/** evaluates all forms in expr, returns the value of the last one. The
+    result is only guaranteed to stay valid until the interpreter runs again,
+    on this or any other thread, unless it is stored in an environment or
+    pinned by gc_root */
+atom exec(environment &env, const std::string &expr) {
+    heap::mutator running;
+    str_view sv(expr);
+
+    tokenizer t(sv);
+
+    // compiler bookkeeping for all forms is dropped at once when done
+    arena scratch;
+    compiler comp(scratch);
+
+    atom result;
+
+    while (t.has_next()) {
+        atom parsed = build_from(t);
+        result = vm::instance().run(*comp.compile(parsed), nullptr, env);
+    }
+
+    return result;
+}
+
+
+std::shared_ptr<environment> shared_std();
+
+/** binary snapshot of the bindings of an environment and everything they
+    reach - lists, closures with their frames and compiled code, numbers
+    and vectors. Objects refer to each other by their index in the image,
+    so an image is position independent and loading it is a pass over the
+    mapped file that rebuilds the objects without parsing or evaluating
+    anything. Builtins are stored by name and linked to those of
+    shared_std() on load. Images use the byte order of the machine that
+    wrote them.
+
+    The file is the header (magic, version, number of symbols, builtins and
+    records), the symbol names, the builtin names, the records and finally
+    the bindings. Each record is a kind, the length of its data and the
+    data; atoms are a type followed by their value, an index for anything
+    not stored inline */
+class image {
+public:
+    /// writes the bindings of env, but not those of its parents, to path
+    static void save(const environment &env, const std::string &path);
+
+    /// binds everything stored in the image at path in env
+    static void load(environment &env, const std::string &path);
+
+    /// whether the file at path is an image
+    static bool probe(const std::string &path);
+
+private:
+    static const char magic[8];
+    static const uint32_t version = 2;
+
+    /// index standing for a null reference
+    static const uint32_t none = 0xffffffff;
+
+    enum record : uint8_t {
+        REC_BLOCK,
+        REC_FRAME,
+        REC_CLOSURE,
+        REC_CODE,
+        REC_BIG,
+        REC_VEC,
+        REC_MEMO,
+        REC_HMAP,
+        REC_OMAP,
+        REC_TEXT,
+        REC_BUILDER
+    };
+
+    class writer;
+    class loader;
+};
+
+const char image::magic[8] = {'L', 'I', 'S', 'P', 'Y', 'I', 'M', 'G'};
+const uint32_t image::version;
+const uint32_t image::none;
+
+class image::writer {
+public:
+    explicit writer(const environment &env) : env(env) {}
+
+    std::string run() {
+        std::string bindings;
+        put32(bindings, env.values.size());
+        for (const auto &kv : env.values) {
+            put32(bindings, symbolIndex(kv.first));
+            putAtom(bindings, kv.second);
+        }
+
+        // records found while writing others are appended to the queue
+        std::string records;
+        for (size_t i = 0; i < queue.size(); ++i) {
+            std::string data;
+            putRecord(data, queue[i]);
+            put8(records, queue[i].kind);
+            put32(records, data.size());
+            records += data;
+        }
+
+        std::string out(magic, sizeof(magic));
+        put32(out, version);
+        put32(out, symbols.size());
+        put32(out, builtins.size());
+        put32(out, queue.size());
+        for (const symbol &s : symbols)
+            putName(out, s.name());
+        for (const builtin *b : builtins)
+            putName(out, b->name);
+        return out + records + bindings;
+    }
+
+private:
+    struct pending {
+        record kind;
+        const void *p;
+    };
+
+    static void put8(std::string &out, uint8_t v) {
+        out += static_cast<char>(v);
+    }
+
+    static void put32(std::string &out, uint32_t v) {
+        out.append(reinterpret_cast<const char *>(&v), sizeof(v));
+    }
+
+    static void put64(std::string &out, uint64_t v) {
+        out.append(reinterpret_cast<const char *>(&v), sizeof(v));
+    }
+
+    static void putName(std::string &out, const std::string &name) {
+        put32(out, name.size());
+        out += name;
+    }
+
+    uint32_t symbolIndex(const symbol &s) {
+        std::unordered_map<symbol, uint32_t, symbol::hash>::iterator i
+                = symbol_ids.find(s);
+        if (i != symbol_ids.end())
+            return i->second;
+        symbols.push_back(s);
+        return symbol_ids[s] = symbols.size() - 1;
+    }
+
+    uint32_t builtinIndex(const builtin *b) {
+        for (size_t i = 0; i < builtins.size(); ++i)
+            if (builtins[i] == b)
+                return i;
+        builtins.push_back(b);
+        return builtins.size() - 1;
+    }
+
+    /// index of the record for p, queued to be written when first seen
+    uint32_t ref(record kind, const void *p) {
+        if (!p)
+            return none;
+
+        std::unordered_map<const void *, uint32_t>::iterator i = ids.find(p);
+        if (i != ids.end())
+            return i->second;
+        queue.push_back(pending{kind, p});
+        return ids[p] = queue.size() - 1;
+    }
+
+    void putAtom(std::string &out, const atom &a) {
+        put8(out, a.t);
+        switch (a.t) {
+        case atom::NIL:
+            break;
+        case atom::INT:
+            put64(out, a.iv);
+            break;
+        case atom::FLT: {
+            uint64_t bits;
+            std::memcpy(&bits, &a.dv, sizeof(bits));
+            put64(out, bits);
+            break;
+        }
+        case atom::SYM:
+            put32(out, symbolIndex(a.sy));
+            break;
+        case atom::LST:
+            // blocks are stored from their first used slot on
+            put32(out, ref(REC_BLOCK, a.lb));
+            put32(out, a.lb ? a.n - a.lb->lo : 0);
+            break;
+        case atom::PRC:
+            put32(out, builtinIndex(a.bi));
+            break;
+        case atom::LMB:
+            put32(out, ref(REC_CLOSURE, a.cl));
+            break;
+        case atom::BIG:
+            put32(out, ref(REC_BIG, a.bg));
+            break;
+        case atom::VEC:
+            put32(out, ref(REC_VEC, a.pv));
+            break;
+        case atom::MEM:
+            put32(out, ref(REC_MEMO, a.mm));
+            break;
+        case atom::MAP:
+            put32(out, ref(REC_HMAP, a.hm));
+            break;
+        case atom::OMP:
+            put32(out, ref(REC_OMAP, a.tn));
+            break;
+        case atom::STR:
+            // short strings are stored in place
+            put32(out, a.n);
+            if (a.n)
+                out.append(a.ch, sizeof(a.ch));
+            else
+                put32(out, ref(REC_TEXT, a.st));
+            break;
+        case atom::BLD:
+            put32(out, ref(REC_BUILDER, a.tb));
+            break;
+        case atom::FUT:
+            throw std::invalid_argument("Cannot save a future");
+        }
+    }
+
+    void putAtoms(std::string &out, const atom *a, size_t n) {
+        put32(out, n);
+        for (size_t i = 0; i < n; ++i)
+            putAtom(out, a[i]);
+    }
+
+    void putRecord(std::string &out, const pending &r) {
+        switch (r.kind) {
+        case REC_BLOCK: {
+            const list::block *b = static_cast<const list::block *>(r.p);
+            putAtoms(out, b->items.data() + b->lo, b->items.size() - b->lo);
+            putAtom(out, atom(b->tail));
+            put64(out, b->tail_size);
+            break;
+        }
+        case REC_FRAME: {
+            const frame *f = static_cast<const frame *>(r.p);
+            putAtoms(out, f->slots.data(), f->slots.size());
+            put32(out, ref(REC_FRAME, f->outer));
+            break;
+        }
+        case REC_CLOSURE: {
+            const closure *c = static_cast<const closure *>(r.p);
+            put32(out, ref(REC_CODE, c->body));
+            put32(out, ref(REC_FRAME, c->outer));
+            put8(out, c->env != nullptr);
+            break;
+        }
+        case REC_CODE: {
+            const code *c = static_cast<const code *>(r.p);
+            put32(out, c->ops.size());
+            for (const instr &i : c->ops) {
+                put8(out, i.op);
+                put32(out, i.arg);
+            }
+            putAtoms(out, c->consts.data(), c->consts.size());
+            put32(out, c->names.size());
+            for (const symbol &s : c->names)
+                put32(out, symbolIndex(s));
+            put32(out, c->params.size());
+            for (const symbol &s : c->params)
+                put32(out, symbolIndex(s));
+            put64(out, c->slots);
+            put8(out, c->captures);
+            putAtom(out, c->definition);
+            put32(out, c->name.null() ? none : symbolIndex(c->name));
+            break;
+        }
+        case REC_BIG: {
+            const bigint &v = static_cast<const bignum *>(r.p)->v;
+            put8(out, v.neg);
+            put32(out, v.mag.size());
+            for (uint32_t l : v.mag)
+                put32(out, l);
+            break;
+        }
+        case REC_VEC: {
+            const packed *p = static_cast<const packed *>(r.p);
+            put8(out, p->real);
+            put32(out, p->size());
+            for (size_t i = 0; i < p->size(); ++i) {
+                uint64_t bits;
+                if (p->real)
+                    std::memcpy(&bits, &p->reals[i], sizeof(bits));
+                else
+                    bits = p->ints[i];
+                put64(out, bits);
+            }
+            break;
+        }
+        case REC_MEMO: {
+            // cached results are not saved
+            const memo *m = static_cast<const memo *>(r.p);
+            put64(out, m->capacity);
+            putAtom(out, m->fn);
+            break;
+        }
+        case REC_HMAP:
+            putPairs(out, static_cast<const hash_map *>(r.p)->pairs());
+            break;
+        case REC_OMAP:
+            putPairs(out, orderedPairs(static_cast<const tree_node *>(r.p)));
+            break;
+        case REC_TEXT: {
+            std::string s;
+            static_cast<const rope *>(r.p)->appendTo(s);
+            putName(out, s);
+            break;
+        }
+        case REC_BUILDER:
+            putName(out, static_cast<const text_builder *>(r.p)->str());
+            break;
+        }
+    }
+
+    /// maps are stored as their (key value) pairs
+    void putPairs(std::string &out, const list &pairs) {
+        put32(out, pairs.size());
+        for (const atom &pair : pairs) {
+            putAtom(out, pair.asList().front());
+            putAtom(out, pair.asList()[1]);
+        }
+    }
+
+    const environment &env;
+    std::vector<symbol> symbols;
+    std::unordered_map<symbol, uint32_t, symbol::hash> symbol_ids;
+    std::vector<const builtin *> builtins;
+    std::vector<pending> queue;
+    std::unordered_map<const void *, uint32_t> ids;
+};
+
+class image::loader {
+public:
+    loader(const char *data, size_t size) : p(data), e(data + size) {}
+
+    void run(environment &env) {
+        if (size_t(e - p) < sizeof(magic)
+            || std::memcmp(p, magic, sizeof(magic)) != 0)
+            throw std::invalid_argument("Not an image");
+        p += sizeof(magic);
+        if (get32() != version)
+            throw std::invalid_argument("Unsupported image version");
+
+        uint32_t nsymbols = get32();
+        uint32_t nbuiltins = get32();
+        uint32_t nrecords = get32();
+
+        for (uint32_t i = 0; i < nsymbols; ++i)
+            symbols.push_back(symbol(getName()));
+
+        std::shared_ptr<environment> std_env = shared_std();
+        for (uint32_t i = 0; i < nbuiltins; ++i) {
+            str_view name = getName();
+            const environment::map &m = std_env->values;
+            environment::map::const_iterator b = m.find(symbol(name));
+            if (b == m.end() || b->second.type() != atom::PRC)
+                throw std::invalid_argument("Unknown builtin " + name.str());
+            builtins.push_back(b->second.bi);
+        }
+
+        // objects are made first and filled in afterwards, as they refer to
+        // each other in any order
+        for (uint32_t i = 0; i < nrecords; ++i) {
+            record kind = static_cast<record>(get8());
+            uint32_t len = get32();
+            need(len);
+            const char *data = p;
+            kinds.push_back(kind);
+            offsets.push_back(data);
+            objects.push_back(make(kind));
+            p = data + len;
+        }
+
+        const char *bindings = p;
+        for (uint32_t i = 0; i < nrecords; ++i) {
+            p = offsets[i];
+            fill(i, env);
+        }
+        rebuild();
+
+        p = bindings;
+        uint32_t n = get32();
+        for (uint32_t i = 0; i < n; ++i) {
+            symbol name = getSymbol();
+            env.define(name, getAtom());
+        }
+    }
+
+private:
+    void need(size_t n) {
+        if (size_t(e - p) < n)
+            throw std::invalid_argument("Corrupt image");
+    }
+
+    uint8_t get8() {
+        need(1);
+        return static_cast<uint8_t>(*p++);
+    }
+
+    uint32_t get32() {
+        uint32_t v;
+        need(sizeof(v));
+        std::memcpy(&v, p, sizeof(v));
+        p += sizeof(v);
+        return v;
+    }
+
+    uint64_t get64() {
+        uint64_t v;
+        need(sizeof(v));
+        std::memcpy(&v, p, sizeof(v));
+        p += sizeof(v);
+        return v;
+    }
+
+    /// number of items following, each taking at least size bytes
+    uint32_t getCount(size_t size) {
+        uint32_t n = get32();
+        need(size_t(n) * size);
+        return n;
+    }
+
+    str_view getName() {
+        uint32_t len = get32();
+        need(len);
+        str_view name(p, p + len);
+        p += len;
+        return name;
+    }
+
+    symbol getSymbol() {
+        uint32_t i = get32();
+        if (i >= symbols.size())
+            throw std::invalid_argument("Corrupt image");
+        return symbols[i];
+    }
+
+    /// object of the record at index i, which has to be of the given kind
+    template <class T>
+    T *getRef(record kind) {
+        uint32_t i = get32();
+        if (i == none)
+            return nullptr;
+        if (i >= objects.size() || kinds[i] != kind)
+            throw std::invalid_argument("Corrupt image");
+        return static_cast<T *>(objects[i]);
+    }
+
+    atom getAtom() {
+        atom a(static_cast<atom::atom_type>(get8()));
+        switch (a.t) {
+        case atom::NIL:
+            break;
+        case atom::INT:
+            a.iv = get64();
+            break;
+        case atom::FLT: {
+            uint64_t bits = get64();
+            std::memcpy(&a.dv, &bits, sizeof(bits));
+            break;
+        }
+        case atom::SYM:
+            a.sy = getSymbol();
+            break;
+        case atom::LST:
+            a.lb = getRef<list::block>(REC_BLOCK);
+            a.n = get32();
+            if (a.lb && a.n >= a.lb->items.size())
+                throw std::invalid_argument("Corrupt image");
+            break;
+        case atom::PRC: {
+            uint32_t i = get32();
+            if (i >= builtins.size())
+                throw std::invalid_argument("Corrupt image");
+            a.bi = builtins[i];
+            break;
+        }
+        case atom::LMB:
+            if (!(a.cl = getRef<closure>(REC_CLOSURE)))
+                throw std::invalid_argument("Corrupt image");
+            break;
+        case atom::BIG:
+            if (!(a.bg = getRef<bignum>(REC_BIG)))
+                throw std::invalid_argument("Corrupt image");
+            break;
+        case atom::VEC:
+            if (!(a.pv = getRef<packed>(REC_VEC)))
+                throw std::invalid_argument("Corrupt image");
+            break;
+        case atom::MEM:
+            if (!(a.mm = getRef<memo>(REC_MEMO)))
+                throw std::invalid_argument("Corrupt image");
+            break;
+        case atom::MAP:
+            if (!(a.hm = getRef<hash_map>(REC_HMAP)))
+                throw std::invalid_argument("Corrupt image");
+            break;
+        case atom::OMP:
+            a.tn = getRef<tree_node>(REC_OMAP);
+            break;
+        case atom::STR:
+            a.n = get32();
+            if (a.n > atom::short_text + 1) {
+                throw std::invalid_argument("Corrupt image");
+            } else if (a.n) {
+                need(sizeof(a.ch));
+                std::memcpy(a.ch, p, sizeof(a.ch));
+                p += sizeof(a.ch);
+            } else if (!(a.st = getRef<rope>(REC_TEXT))) {
+                throw std::invalid_argument("Corrupt image");
+            }
+            break;
+        case atom::BLD:
+            if (!(a.tb = getRef<text_builder>(REC_BUILDER)))
+                throw std::invalid_argument("Corrupt image");
+            break;
+        default:
+            throw std::invalid_argument("Corrupt image");
+        }
+        return a;
+    }
+
+    /** makes the object of a record, empty unless it refers to no others.
+        Block sizes are known up front, so atoms can check their offsets */
+    object *make(record kind) {
+        heap &h = heap::instance();
+        switch (kind) {
+        case REC_BLOCK: {
+            list::block *b = h.make<list::block>();
+            b->items.resize(getCount(1));
+            h.account(b->items.capacity() * sizeof(atom));
+            return b;
+        }
+        case REC_FRAME:
+            return h.make<frame>(0, nullptr);
+        case REC_CLOSURE:
+            return h.make<closure>(nullptr, nullptr, nullptr);
+        case REC_CODE:
+            return h.make<code>();
+        case REC_BIG: {
+            bigint v;
+            v.neg = get8();
+            uint32_t n = getCount(sizeof(uint32_t));
+            for (uint32_t i = 0; i < n; ++i)
+                v.mag.push_back(get32());
+            bignum *b = h.make<bignum>(std::move(v));
+            h.account(b->v.mag.capacity() * sizeof(uint32_t));
+            return b;
+        }
+        case REC_VEC: {
+            bool real = get8();
+            uint32_t n = getCount(sizeof(uint64_t));
+            packed *v = h.make<packed>(real, n);
+            h.account(n * 8);
+            for (uint32_t i = 0; i < n; ++i) {
+                uint64_t bits = get64();
+                if (real)
+                    std::memcpy(&v->reals[i], &bits, sizeof(bits));
+                else
+                    v->ints[i] = bits;
+            }
+            return v;
+        }
+        case REC_MEMO:
+            return h.make<memo>(atom(), get64());
+        case REC_HMAP:
+            return h.make<hash_map>();
+        case REC_OMAP:
+            return h.make<tree_node>(atom(), atom(), nullptr, nullptr, 0);
+        case REC_TEXT: {
+            rope *r = h.make<rope>(getName().str());
+            h.account(r->footprint() - sizeof(*r));
+            return r;
+        }
+        case REC_BUILDER: {
+            text_builder *b = h.make<text_builder>();
+            b->append(atom::text(getName()));
+            return b;
+        }
+        }
+        throw std::invalid_argument("Corrupt image");
+    }
+
+    void fill(uint32_t i, environment &env) {
+        heap &h = heap::instance();
+        switch (kinds[i]) {
+        case REC_BLOCK: {
+            list::block *b = static_cast<list::block *>(objects[i]);
+            uint32_t n = getCount(1);
+            if (n != b->items.size())
+                throw std::invalid_argument("Corrupt image");
+            for (uint32_t k = 0; k < n; ++k)
+                b->items[k] = getAtom();
+            atom tail = getAtom();
+            if (tail.type() != atom::LST)
+                throw std::invalid_argument("Corrupt image");
+            b->tail = list(tail.lb, tail.n);
+            b->tail_size = get64();
+            break;
+        }
+        case REC_FRAME: {
+            frame *f = static_cast<frame *>(objects[i]);
+            uint32_t n = getCount(1);
+            f->slots.resize(n);
+            h.account(n * sizeof(atom));
+            for (uint32_t k = 0; k < n; ++k)
+                f->slots[k] = getAtom();
+            f->outer = getRef<frame>(REC_FRAME);
+            break;
+        }
+        case REC_CLOSURE: {
+            closure *c = static_cast<closure *>(objects[i]);
+            if (!(c->body = getRef<code>(REC_CODE)))
+                throw std::invalid_argument("Corrupt image");
+            c->outer = getRef<frame>(REC_FRAME);
+            c->env = get8() ? env.link() : nullptr;
+            break;
+        }
+        case REC_CODE: {
+            code *c = static_cast<code *>(objects[i]);
+            uint32_t n = getCount(1 + sizeof(uint32_t));
+            for (uint32_t k = 0; k < n; ++k) {
+                opcode op = static_cast<opcode>(get8());
+                if (op > OP_RETURN)
+                    throw std::invalid_argument("Corrupt image");
+                c->ops.push_back(instr(op, get32()));
+            }
+            n = getCount(1);
+            for (uint32_t k = 0; k < n; ++k)
+                c->consts.push_back(getAtom());
+            n = getCount(sizeof(uint32_t));
+            for (uint32_t k = 0; k < n; ++k)
+                c->names.push_back(getSymbol());
+            n = getCount(sizeof(uint32_t));
+            for (uint32_t k = 0; k < n; ++k)
+                c->params.push_back(getSymbol());
+            c->slots = get64();
+            c->captures = get8();
+            c->definition = getAtom();
+            uint32_t name = get32();
+            if (name != none && name >= symbols.size())
+                throw std::invalid_argument("Corrupt image");
+            if (name != none)
+                c->name = symbols[name];
+            check(*c);
+            h.account(c->footprint() - sizeof(*c));
+            break;
+        }
+        case REC_MEMO:
+            get64();  // the capacity, already known
+            static_cast<memo *>(objects[i])->fn = getAtom();
+            break;
+        case REC_HMAP:
+        case REC_OMAP: {
+            std::vector<atom> &items = pairs[i];
+            uint32_t n = getCount(2);
+            for (uint32_t k = 0; k < 2 * n; ++k)
+                items.push_back(getAtom());
+            break;
+        }
+        case REC_BIG:
+        case REC_VEC:
+        case REC_TEXT:
+        case REC_BUILDER:
+            break;
+        }
+    }
+
+    /** maps are rebuilt once everything else is loaded, as the order of
+        keys and their hashes may differ from the process that saved them.
+        Ordered maps are compared and hashed by their content, so those
+        used in keys are built first, and all of them before the hash maps */
+    void rebuild() {
+        for (const auto &r : pairs) {
+            if (kinds[r.first] == REC_OMAP)
+                unbuilt[objects[r.first]] = r.first;
+        }
+        for (const auto &r : pairs) {
+            if (kinds[r.first] == REC_OMAP)
+                build(r.first);
+        }
+
+        for (const auto &r : pairs) {
+            if (kinds[r.first] != REC_HMAP)
+                continue;
+            hash_map *m = static_cast<hash_map *>(objects[r.first]);
+            for (size_t k = 0; k < r.second.size(); k += 2)
+                m->put(r.second[k], r.second[k + 1]);
+        }
+    }
+
+    /// builds the ordered map at index i anew, copying its root into the
+    /// node other records refer to
+    void build(uint32_t i) {
+        if (!unbuilt.erase(objects[i]))
+            return;
+
+        const std::vector<atom> &items = pairs[i];
+        for (const atom &a : items)
+            prepare(a);
+
+        const tree_node *t = nullptr;
+        for (size_t k = 0; k < items.size(); k += 2)
+            t = tree_node::insert(t, items[k], items[k + 1]);
+        if (!t)
+            throw std::invalid_argument("Corrupt image");
+
+        tree_node *root = static_cast<tree_node *>(objects[i]);
+        root->key = t->key;
+        root->value = t->value;
+        root->left = t->left;
+        root->right = t->right;
+        root->size = t->size;
+        root->prio = t->prio;
+    }
+
+    /// builds the ordered maps a is made of
+    void prepare(const atom &a) {
+        if (a.t == atom::OMP) {
+            std::unordered_map<const object *, uint32_t>::iterator i
+                    = unbuilt.find(a.tn);
+            if (i != unbuilt.end())
+                build(i->second);
+        } else if (a.t == atom::LST) {
+            for (const atom &item : a.asList())
+                prepare(item);
+        }
+    }
+
+    /** operands have to be in range of the code. Images are trusted not to
+        be made up, this only catches damaged files */
+    static void check(const code &c) {
+        for (const instr &i : c.ops) {
+            bool valid = true;
+            switch (i.op) {
+            case OP_CONST:
+                valid = i.arg < c.consts.size();
+                break;
+            case OP_LAMBDA:
+                valid = i.arg < c.consts.size()
+                        && c.consts[i.arg].type() == atom::LMB;
+                break;
+            case OP_GLOBAL:
+            case OP_SET_GLOBAL:
+                valid = i.arg < c.names.size();
+                break;
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+                valid = i.arg < c.ops.size();
+                break;
+            default:
+                break;
+            }
+            if (!valid)
+                throw std::invalid_argument("Corrupt image");
+        }
+    }
+
+    const char *p;
+    const char *e;
+    std::vector<symbol> symbols;
+    std::vector<const builtin *> builtins;
+    std::vector<record> kinds;
+    std::vector<const char *> offsets;
+    std::vector<object *> objects;
+    std::unordered_map<uint32_t, std::vector<atom>> pairs;
+    std::unordered_map<const object *, uint32_t> unbuilt;
+};
+
+void image::save(const environment &env, const std::string &path) {
+    std::string data;
+    {
+        heap::mutator running;
+        data = writer(env).run();
+    }
+
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        throw std::invalid_argument("Cannot write " + path);
+
+    for (size_t done = 0; done < data.size();) {
+        ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            ::close(fd);
+            throw std::invalid_argument("Cannot write " + path + ": "
+                                        + std::strerror(errno));
+        }
+        done += n;
+    }
+
+    ::close(fd);
+}
+
+void image::load(environment &env, const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::invalid_argument("Cannot open " + path);
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+        throw std::invalid_argument("Not an image: " + path);
+    }
+
+    void *m = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (m == MAP_FAILED)
+        throw std::invalid_argument("Cannot map " + path);
+
+    // records are visited twice front to back
+    ::madvise(m, st.st_size, MADV_WILLNEED);
+    try {
+        heap::mutator running;
+        loader(static_cast<const char *>(m), st.st_size).run(env);
+    } catch (...) {
+        ::munmap(m, st.st_size);
+        throw;
+    }
+    ::munmap(m, st.st_size);
+}
+
+bool image::probe(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    char head[sizeof(magic)];
+    ssize_t n = ::read(fd, head, sizeof(head));
+    ::close(fd);
+    return n == ssize_t(sizeof(head))
+            && std::memcmp(head, magic, sizeof(magic)) == 0;
+}
+
+void bind_std(environment &env) {
+    // special forms are compiled inline, they are bound only to mark them
+    static const builtin specials[] = {
+        builtin("quote"),
+        builtin("if"),
+        builtin("lambda"),
+        builtin("define"),
+        builtin("set!"),
+        builtin("setq"),
+        builtin("defmemo"),
+        builtin("profile"),
+    };
+
+    static const builtin builtins[] = {
+        // all visible bindings, outer ones unless shadowed
+        builtin("env", [](environment &env) {
+            binding_guard guard(false);
+            list::builder aenv;
+            for (const environment *e = &env; e; e = e->outer.get()) {
+                for (const auto &kv : e->values) {
+                    bool shadowed = false;
+                    for (const environment *in = &env; in != e;
+                         in = in->outer.get())
+                        shadowed = shadowed || in->values.count(kv.first);
+                    if (shadowed)
+                        continue;
+
+                    list::builder val;
+                    val.push_back(atom(kv.first));
+                    val.push_back(kv.second);
+                    aenv.push_back(atom(val.done()));
+                }
+            }
+            return atom(aenv.done());
+        }),
+
+        builtin("list", [](environment &, const atom *v, size_t n) {
+            list::builder lst;
+            for (size_t i = 0; i < n; ++i)
+                lst.push_back(v[i]);
+            return atom(lst.done());
+        }),
+
+        builtin("length", [](environment &, const atom &l) {
+            return l.length();
+        }),
+
+        builtin("eval", [](environment &env, const atom &e) {
+            return e.eval(env);
+        }),
+
+        // paths are strings, or quoted symbols as before there were any
+        builtin("load", [](environment &env, const atom &path) {
+            return load(env, textOf(path));
+        }),
+
+        builtin("save-image", [](environment &env, const atom &path) {
+            image::save(env, textOf(path));
+            return atom::True;
+        }),
+
+        builtin("load-image", [](environment &env, const atom &path) {
+            image::load(env, textOf(path));
+            return atom::True;
+        }),
+
+        // the last list is shared as the tail of the result, the others copied
+        builtin("append", [](environment &, const atom *v, size_t n) {
+            list::builder lst;
+            for (size_t i = 0; i + 1 < n; ++i)
+                for (const atom &e : v[i].asList())
+                    lst.push_back(e);
+            return atom(lst.done(n ? v[n - 1].asList() : list()));
+        }),
+
+        builtin("cons", [](environment &, const atom &a, const atom &rest) {
+            if (rest.type() == atom::NIL)
+                return atom(list::Empty.cons(a));
+            return atom(rest.asList().cons(a));
+        }),
+
+        builtin("car", [](environment &, const atom &l) {
+            return l.front();
+        }),
+
+        builtin("cdr", [](environment &, const atom &l) {
+            return l.rest();
+        }),
+
+        builtin("*", [](environment &, const atom *v, size_t n) {
+            atom res(1);
+            for (size_t i = 0; i < n; ++i)
+                res = numMul(res, v[i]);
+            return res;
+        }),
+
+        builtin("+", [](environment &, const atom *v, size_t n) {
+            atom res(0);
+            for (size_t i = 0; i < n; ++i)
+                res = numAdd(res, v[i]);
+            return res;
+        }),
+
+        // with a single argument - and / negate and invert it
+        builtin("-", [](environment &, const atom *v, size_t n) {
+            if (n == 1)
+                return numSub(atom(0), v[0]);
+            atom res = v[0];
+            for (size_t i = 1; i < n; ++i)
+                res = numSub(res, v[i]);
+            return res;
+        }, 1),
+
+        builtin("/", [](environment &, const atom *v, size_t n) {
+            if (n == 1)
+                return numDiv(atom(1), v[0]);
+            atom res = v[0];
+            for (size_t i = 1; i < n; ++i)
+                res = numDiv(res, v[i]);
+            return res;
+        }, 1),
+
+        builtin("=", [](environment &, const atom *v, size_t n) {
+            for (size_t i = 1; i < n; ++i)
+                if (numCompare(v[i - 1], v[i]) != 0)
+                    return atom::False;
+            return atom::True;
+        }, 1),
+
+        builtin("<", [](environment &, const atom *v, size_t n) {
+            for (size_t i = 1; i < n; ++i)
+                if (numCompare(v[i - 1], v[i]) != -1)
+                    return atom::False;
+            return atom::True;
+        }, 1),
+
+        builtin(">", [](environment &, const atom *v, size_t n) {
+            for (size_t i = 1; i < n; ++i)
+                if (numCompare(v[i - 1], v[i]) != 1)
+                    return atom::False;
+            return atom::True;
+        }, 1),
+
+        builtin("vec", [](environment &, const atom *v, size_t n) {
+            return packNumbers(v, n);
+        }),
+
+        builtin("list->vec", [](environment &, const atom &l) {
+            if (l.type() == atom::NIL)
+                return packNumbers(nullptr, 0);
+            std::vector<atom> items;
+            for (const atom &e : l.asList())
+                items.push_back(e);
+            return packNumbers(items.data(), items.size());
+        }),
+
+        builtin("vec->list", [](environment &, const atom &v) {
+            const packed &p = v.asPacked();
+            list::builder lst;
+            for (size_t i = 0; i < p.size(); ++i)
+                lst.push_back(p.at(i));
+            return atom(lst.done());
+        }),
+
+        builtin("vlen", [](environment &, const atom &v) {
+            return atom(static_cast<int64_t>(v.asPacked().size()));
+        }),
+
+        builtin("vref", [](environment &, const atom &v, const atom &i) {
+            const packed &p = v.asPacked();
+            int64_t idx = i.asInt();
+            if (idx < 0 || static_cast<size_t>(idx) >= p.size())
+                throw std::invalid_argument("Index out of range");
+            return p.at(idx);
+        }),
+
+        builtin("v+", [](environment &, const atom &a, const atom &b) {
+            return packedZip(PACK_ADD, a, b);
+        }),
+
+        builtin("v-", [](environment &, const atom &a, const atom &b) {
+            return packedZip(PACK_SUB, a, b);
+        }),
+
+        builtin("v*", [](environment &, const atom &a, const atom &b) {
+            return packedZip(PACK_MUL, a, b);
+        }),
+
+        builtin("v/", [](environment &, const atom &a, const atom &b) {
+            return packedZip(PACK_DIV, a, b);
+        }),
+
+        // comparisons give integer vectors of 1 where they hold, 0 elsewhere
+        builtin("v<", [](environment &, const atom &a, const atom &b) {
+            return packedZip(PACK_LT, a, b);
+        }),
+
+        builtin("v>", [](environment &, const atom &a, const atom &b) {
+            return packedZip(PACK_GT, a, b);
+        }),
+
+        builtin("v=", [](environment &, const atom &a, const atom &b) {
+            return packedZip(PACK_EQ, a, b);
+        }),
+
+        builtin("vsum", [](environment &, const atom &v) {
+            return packedReduce(PACK_ADD, v);
+        }),
+
+        builtin("vmin", [](environment &, const atom &v) {
+            return packedReduce(PACK_MIN, v);
+        }),
+
+        builtin("vmax", [](environment &, const atom &v) {
+            return packedReduce(PACK_MAX, v);
+        }),
+
+        builtin("vdot", [](environment &, const atom &a, const atom &b) {
+            return packedDot(a, b);
+        }),
+
+        builtin("equal?", [](environment &, const atom &a, const atom &b) {
+            return a == b ? atom::True : atom::False;
+        }),
+
+        builtin("eq?", [](environment &, const atom &a, const atom &b) {
+            return a.identical(b) ? atom::True : atom::False;
+        }),
+
+        builtin("hash", [](environment &, const atom &a) {
+            // kept positive and exact, so it is an INT on any platform
+            return atom(static_cast<int64_t>(atom::hash()(a) >> 2));
+        }),
+
+        builtin("hashcons", [](environment &, const atom &a) {
+            return list_table::instance().intern(a);
+        }),
+
+        /* (profile-call f [path]) calls f without arguments while recording
+           a profile, prints it to stderr and writes collapsed stacks to
+           path. Calls made while recording already are just made */
+        builtin("profile-call", [](environment &env, const atom *v,
+                                   size_t n) {
+            // calling f may move the stack v points into
+            atom f = v[0], path = n > 1 ? v[1] : atom();
+            if (profiler::running())
+                return vm::instance().invoke(f, env, nullptr, 0);
+
+            profiler &p = profiler::instance();
+            p.start();
+            atom result;
+            try {
+                result = vm::instance().invoke(f, env, nullptr, 0);
+            } catch (...) {
+                p.stop();
+                throw;
+            }
+            p.stop();
+
+            p.report(std::cerr);
+            if (n > 1)
+                p.collapsed(textOf(path));
+            return result;
+        }, 1),
+
+        // (memoize f [capacity]) caches up to capacity results of f
+        builtin("memoize", [](environment &, const atom *v, size_t n) {
+            const size_t default_capacity = 4096;
+            int64_t capacity = n > 1 ? v[1].asInt() : default_capacity;
+            if (n > 2 || capacity < 1)
+                throw std::invalid_argument("Invalid memoize arguments");
+
+            if (v[0].type() != atom::LMB && v[0].type() != atom::PRC
+                && v[0].type() != atom::MEM)
+                throw std::invalid_argument("Cannot memoize " + v[0].repr());
+            heap &h = heap::instance();
+            return atom(h.make<memo>(v[0], capacity));
+        }, 1),
+
+        builtin("hash-map", [](environment &, const atom *v, size_t n) {
+            if (n % 2)
+                throw std::invalid_argument("Keys without values");
+            hash_map *m = heap::instance().make<hash_map>();
+            for (size_t i = 0; i < n; i += 2)
+                m->put(v[i], v[i + 1]);
+            return atom(m);
+        }),
+
+        // (hash-get map key [default]), nil if there is no default
+        builtin("hash-get", [](environment &, const atom *v, size_t n) {
+            atom value;
+            if (!v[0].asMap().find(v[1], value) && n > 2)
+                value = v[2];
+            return value;
+        }, 2),
+
+        builtin("hash-put!", [](environment &, const atom &m, const atom &k,
+                                const atom &v) {
+            m.asMap().put(k, v);
+            return m;
+        }),
+
+        builtin("hash-remove!", [](environment &, const atom &m,
+                                   const atom &k) {
+            return m.asMap().remove(k) ? atom::True : atom::False;
+        }),
+
+        builtin("hash-has?", [](environment &, const atom &m, const atom &k) {
+            atom value;
+            return m.asMap().find(k, value) ? atom::True : atom::False;
+        }),
+
+        builtin("hash-count", [](environment &, const atom &m) {
+            return atom(static_cast<int64_t>(m.asMap().size()));
+        }),
+
+        builtin("hash->list", [](environment &, const atom &m) {
+            return atom(m.asMap().pairs());
+        }),
+
+        builtin("omap", [](environment &, const atom *v, size_t n) {
+            if (n % 2)
+                throw std::invalid_argument("Keys without values");
+            const tree_node *t = nullptr;
+            for (size_t i = 0; i < n; i += 2)
+                t = tree_node::insert(t, v[i], v[i + 1]);
+            return atom::ordered(t);
+        }),
+
+        // (omap-get map key [default]), nil if there is no default
+        builtin("omap-get", [](environment &, const atom *v, size_t n) {
+            const tree_node *t = tree_node::find(v[0].asTree(), v[1]);
+            return t ? t->value : n > 2 ? v[2] : atom();
+        }, 2),
+
+        builtin("omap-put", [](environment &, const atom &m, const atom &k,
+                               const atom &v) {
+            return atom::ordered(tree_node::insert(m.asTree(), k, v));
+        }),
+
+        builtin("omap-remove", [](environment &, const atom &m,
+                                  const atom &k) {
+            return atom::ordered(tree_node::remove(m.asTree(), k));
+        }),
+
+        builtin("omap-has?", [](environment &, const atom &m, const atom &k) {
+            return tree_node::find(m.asTree(), k) ? atom::True : atom::False;
+        }),
+
+        builtin("omap-count", [](environment &, const atom &m) {
+            return atom(static_cast<int64_t>(tree_node::count(m.asTree())));
+        }),
+
+        builtin("omap->list", [](environment &, const atom &m) {
+            return atom(orderedPairs(m.asTree()));
+        }),
+
+        builtin("string?", [](environment &, const atom &a) {
+            return a.type() == atom::STR ? atom::True : atom::False;
+        }),
+
+        builtin("string-length", [](environment &, const atom &s) {
+            return atom(static_cast<int64_t>(s.textSize()));
+        }),
+
+        builtin("string-append", [](environment &, const atom *v, size_t n) {
+            atom s = atom::text(str_view());
+            for (size_t i = 0; i < n; ++i)
+                s = concatText(s, v[i]);
+            return s;
+        }),
+
+        // (substring s from [to]), to the end without to
+        builtin("substring", [](environment &, const atom *v, size_t n) {
+            int64_t from = v[1].asInt();
+            int64_t to = n > 2 ? v[2].asInt() : v[0].textSize();
+            if (from < 0 || to < 0)
+                throw std::invalid_argument("Substring out of range");
+            return substring(v[0], from, to);
+        }, 2),
+
+        builtin("string->symbol", [](environment &, const atom &s) {
+            return atom(symbol(s.asText()));
+        }),
+
+        builtin("symbol->string", [](environment &, const atom &s) {
+            return atom::text(str_view(s.asSymbol().name()));
+        }),
+
+        // (string-builder x ...) with the printed values of the arguments
+        builtin("string-builder", [](environment &, const atom *v, size_t n) {
+            text_builder *b = heap::instance().make<text_builder>();
+            for (size_t i = 0; i < n; ++i)
+                b->append(v[i]);
+            return atom(b);
+        }),
+
+        builtin("string-builder-add!", [](environment &, const atom *v,
+                                          size_t n) {
+            text_builder &b = v[0].asBuilder();
+            for (size_t i = 1; i < n; ++i)
+                b.append(v[i]);
+            return v[0];
+        }, 1),
+
+        builtin("string-builder-length", [](environment &, const atom &b) {
+            return atom(static_cast<int64_t>(b.asBuilder().size()));
+        }),
+
+        builtin("string-builder->string", [](environment &, const atom &b) {
+            return atom::text(str_view(b.asBuilder().str()));
+        }),
+
+        /* (future f args...) calls f with args on the thread pool and
+           returns at once, touch waits for the value. It takes a function
+           rather than an expression, which would be evaluated before the
+           call: (touch (future (lambda () (+ 1 2)))) */
+        builtin("future", [](environment &env, const atom *v, size_t n) {
+            heap &h = heap::instance();
+            task *t = h.make<task>(task::CALL, v[0], env);
+            t->args.assign(v + 1, v + n);
+            h.account(t->args.capacity() * sizeof(atom));
+            scheduler::instance().submit(t);
+            return atom(t);
+        }, 1),
+
+        builtin("touch", [](environment &, const atom &f) {
+            return touch(f);
+        }),
+
+        builtin("pmap", [](environment &env, const atom &fn, const atom &l) {
+            list::builder out;
+            for (task *t : parallel(task::MAP, fn, l, env))
+                for (const atom &a : t->result.asList())
+                    out.push_back(a);
+            return atom(out.done());
+        }),
+
+        // fn has to be associative, chunks are folded independently
+        builtin("preduce", [](environment &env, const atom &f,
+                              const atom &init, const atom &l) {
+            // waiting for the tasks may run them here and move the stack
+            // f and init point into
+            atom fn = f, acc = init;
+            gc_root keep_fn(fn), keep_acc(acc);
+
+            list::builder parts;
+            for (task *t : parallel(task::REDUCE, fn, l, env))
+                parts.push_back(t->result);
+            atom rest(parts.done());
+            gc_root keep_parts(rest);
+
+            for (const atom &r : rest.asList()) {
+                const atom pair[] = {acc, r};
+                acc = vm::instance().invoke(fn, env, pair, 2);
+            }
+            return acc;
+        }),
+    };
+
+    env.set("nil") = atom::Nil;
+    env.set("#t") = atom::True;
+    env.set("#f") = atom::False;
+
+    for (const builtin &b : specials)
+        env.set(b.name) = atom(&b);
+
+    for (const builtin &b : builtins)
+        env.set(b.name) = atom(&b);
+}
+
+/** frozen environment holding the bindings of bind_std, built on first use
+    and shared by every caller. Cheap to use as the parent of per job
+    environments:
+
+        lispy::environment env(lispy::shared_std());
+
+    Jobs may run on threads of their own at the same time. They share the
+    heap, a collection started by one stops the others at their next
+    safepoint. Values they exchange are kept alive by the environment they
+    are stored in, not the one they were made in */
+std::shared_ptr<environment> shared_std() {
+    static std::shared_ptr<environment> base = [] {
+        std::shared_ptr<environment> env = std::make_shared<environment>();
+        bind_std(*env);
+        env->freeze();
+        return env;
+    }();
+    return base;
 }
 
 } // namespace lispy
@@ -0,0 +1,65 @@
+#ifndef LISPY_TEST_CHECK_H
+#define LISPY_TEST_CHECK_H
+
+#include <iostream>
+#include <string>
+
+#include "lispy.h"
+
+/* minimal checks for the programs in this directory. Each one is a program
+   of its own that make check builds and runs, it reports every failed check
+   and exits with a non zero status if there were any:
+
+       int main() {
+           lispy::environment env(lispy::shared_std());
+           CHECK_EVAL(env, "(+ 1 2)", "3");
+           CHECK_ERROR(env, "(car 1)");
+           return check::done();
+       }
+ */
+
+namespace check {
+
+int failures = 0;
+
+void fail(int line, const std::string &what) {
+    std::cerr << "line " << line << ": " << what << std::endl;
+    ++failures;
+}
+
+/// evaluates src, the last value printed has to be expected
+void eval(lispy::environment &env, const std::string &src,
+          const std::string &expected, int line) {
+    try {
+        std::string got = lispy::exec(env, src).repr();
+        if (got != expected)
+            fail(line, src + " gave " + got + ", expected " + expected);
+    } catch (const std::exception &e) {
+        fail(line, src + " failed: " + e.what());
+    }
+}
+
+/// evaluating src has to raise an error
+void error(lispy::environment &env, const std::string &src, int line) {
+    try {
+        std::string got = lispy::exec(env, src).repr();
+        fail(line, src + " gave " + got + ", expected an error");
+    } catch (const std::exception &) {
+    }
+}
+
+int done() {
+    if (failures)
+        std::cerr << failures << " checks failed" << std::endl;
+    return failures ? 1 : 0;
+}
+
+} // namespace check
+
+#define CHECK(cond) \
+    do { if (!(cond)) check::fail(__LINE__, #cond); } while (0)
+#define CHECK_EVAL(env, src, expected) \
+    check::eval(env, src, expected, __LINE__)
+#define CHECK_ERROR(env, src) check::error(env, src, __LINE__)
+
+#endif
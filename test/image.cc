@@ -0,0 +1,60 @@
+#include <cstdio>
+
+#include "check.h"
+
+/* what save-image writes load-image gives back: values, lambdas with their
+   closures and names, and the objects they share */
+int main() {
+    const std::string path = "test/image.img.tmp";
+    lispy::environment a(lispy::shared_std());
+    lispy::exec(a, "(define xs (cons 1 (cons 2 (quote (3 4)))))"
+                   "(define ys (cdr xs))"
+                   "(define s \"text\")"
+                   "(define big 123456789012345678901234567890)"
+                   "(define f 1.5)"
+                   "(define v (vec 1 2 3))"
+                   "(define h (hash-map))"
+                   "(hash-put! h (quote (1 2)) \"list key\")"
+                   "(hash-put! h \"k\" 7)"
+                   "(define o (omap (quote (2 1)) 20 (quote (1 2)) 10))"
+                   "(define adder (lambda (n) (lambda (x) (+ x n))))"
+                   "(define add5 (adder 5))"
+                   "(define sq (lambda (x) (* x x)))"
+                   "(defmemo fib (n)"
+                   "  (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))"
+                   "(fib 40)"
+                   "(define b (string-builder))"
+                   "(string-builder-add! b \"ab\")");
+    lispy::image::save(a, path);
+
+    lispy::environment b(lispy::shared_std());
+    lispy::image::load(b, path);
+    std::remove(path.c_str());
+
+    for (const char *name : {"xs", "ys", "s", "big", "f", "v", "h", "o",
+                             "sq", "adder", "add5"}) {
+        CHECK_EVAL(b, name, lispy::exec(a, name).repr());
+    }
+
+    CHECK_EVAL(b, "(car ys)", "2");
+    CHECK_EVAL(b, "(length xs)", "4");
+    CHECK_EVAL(b, "(+ big 1)", "123456789012345678901234567891");
+    CHECK_EVAL(b, "(hash-get h (list 1 2))", "\"list key\"");
+    CHECK_EVAL(b, "(hash-get h \"k\")", "7");
+    CHECK_EVAL(b, "(omap-get o (list 1 2))", "10");
+    CHECK_EVAL(b, "(omap->list o)", lispy::exec(a, "(omap->list o)").repr());
+    CHECK_EVAL(b, "(add5 1)", "6");
+    CHECK_EVAL(b, "((adder 2) 1)", "3");
+    CHECK_EVAL(b, "(fib 80)", "23416728348467685");
+    CHECK_EVAL(b, "(string-builder->string b)", "\"ab\"");
+
+    // loaded lambdas see the globals of the environment they are loaded in
+    lispy::exec(b, "(define g (lambda () calls)) (define calls 3)");
+    CHECK_EVAL(b, "(g)", "3");
+
+    // lists shared by two bindings stay shared
+    CHECK_EVAL(b, "(eq? ys (cdr xs))", "#t");
+
+    CHECK_ERROR(b, "(load-image \"test/no-such-image\")");
+    return check::done();
+}
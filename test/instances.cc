@@ -0,0 +1,75 @@
+#include <thread>
+#include <vector>
+
+#include "check.h"
+
+/* interpreter instances on threads of their own, sharing a frozen parent
+   environment and the heap. Enough is allocated for collections to happen
+   while the others run */
+std::string run(std::shared_ptr<lispy::environment> common, int id) {
+    lispy::environment env(common);
+    lispy::exec(env, "(define build (lambda (n acc)"
+                     "  (if (< n 1) acc (build (- n 1) (cons n acc)))))"
+                     "(define sum (lambda (l acc)"
+                     "  (if (= (length l) 0) acc"
+                     "      (sum (cdr l) (+ acc (car l))))))"
+                     "(define id " + std::to_string(id) + ")");
+    std::string out;
+    for (int i = 0; i < 4; ++i) {
+        out += lispy::exec(env, "(+ id (sum (build 100000 (quote ())) 0))")
+                .repr() + " ";
+    }
+
+    // every instance conses onto the same shared list, which has a free
+    // slot below it for one of them to claim
+    for (int i = 0; i < 1000; ++i) {
+        std::string l = lispy::exec(env, "(define l (cons id base))"
+                                         "(if (= (car l) id) (length l) 0)")
+                            .repr();
+        if (l != "4")
+            return "cons gave " + l;
+    }
+    return out;
+}
+
+int main() {
+    std::shared_ptr<lispy::environment> common =
+        std::make_shared<lispy::environment>(lispy::shared_std());
+    lispy::exec(*common, "(define base (cons 1 (cons 2 (cons 3 nil))))");
+    common->freeze();
+
+    const int n = 3;
+    std::vector<std::string> results(n);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < n; ++i) {
+        threads.push_back(std::thread([common, i, &results] {
+            try {
+                results[i] = run(common, i);
+            } catch (const std::exception &e) {
+                results[i] = e.what();
+            }
+        }));
+    }
+    for (std::thread &t : threads)
+        t.join();
+
+    for (int i = 0; i < n; ++i) {
+        std::string sum = std::to_string(5000050000 + i) + " ";
+        std::string expected;
+        for (int k = 0; k < 4; ++k)
+            expected += sum;
+        if (results[i] != expected)
+            check::fail(__LINE__, "instance " + std::to_string(i) + " gave "
+                        + results[i]);
+    }
+    CHECK(lispy::heap::instance().made().collections > 0);
+
+    // a lambda from one instance called by another sees its own globals
+    lispy::environment a(lispy::shared_std()), b(lispy::shared_std());
+    lispy::exec(a, "(define x 1) (define f (lambda () x))");
+    lispy::exec(b, "(define x 2)");
+    b.set("g") = lispy::exec(a, "f");
+    CHECK_EVAL(b, "(g)", "1");
+
+    return check::done();
+}
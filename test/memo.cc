@@ -0,0 +1,47 @@
+#include "check.h"
+
+/* memoized lambdas and structural equality, hashing, hash consing and
+   printing, on data deep enough to overflow the stack with recursion */
+int main() {
+    lispy::environment env(lispy::shared_std());
+    lispy::exec(env, "(define nest (lambda (n acc)"
+                     "  (if (< n 1) acc (nest (- n 1) (list acc)))))"
+                     "(define deep (nest 200000 (quote ())))"
+                     "(define deep2 (nest 200000 (quote ())))");
+
+    CHECK_EVAL(env, "(defmemo fib (n)"
+                    "  (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))"
+                    "(fib 90)", "2880067194370816120");
+    CHECK_EVAL(env, "(defmemo down (n) (if (< n 1) 0 (+ 1 (down (- n 1)))))"
+                    "(down 100000)", "100000");
+    CHECK_EVAL(env, "(down 100000)", "100000");
+    CHECK_EVAL(env, "(define sq (memoize (lambda (x) (* x x))))"
+                    "(list (sq 3) (sq 3) (sq (quote 4)))", "(9 9 16)");
+    CHECK_ERROR(env, "(memoize 1)");
+    CHECK_ERROR(env, "(defmemo bad (n) (car n)) (bad 1)");
+
+    // memo keys are compared by value
+    CHECK_EVAL(env, "(define len (memoize (lambda (l) (length l))))"
+                    "(list (len (list 1 2)) (len (quote (1 2))))", "(2 2)");
+
+    CHECK_EVAL(env, "(equal? deep deep2)", "#t");
+    CHECK_EVAL(env, "(equal? deep (nest 199999 (quote ())))", "nil");
+    CHECK_EVAL(env, "(= (hash deep) (hash deep2))", "#t");
+    CHECK_EVAL(env, "(eq? deep deep2)", "nil");
+    CHECK_EVAL(env, "(eq? (hashcons deep) (hashcons deep2))", "#t");
+    CHECK_EVAL(env, "(eq? (hashcons (list 1 \"a\" 2.5))"
+                    "     (hashcons (list 1 \"a\" 2.5)))", "#t");
+    CHECK_EVAL(env, "(eq? (hashcons (list 1 2)) (hashcons (list 1 3)))",
+               "nil");
+
+    std::string printed = lispy::exec(env, "deep").repr();
+    CHECK(printed.size() == 2 * 200001);
+    CHECK(printed.compare(0, 4, "((((") == 0);
+
+    CHECK_EVAL(env, "(define o (omap (list 2 1) 21 (list 1 2) 12 deep 0))"
+                    "(list (omap-get o (quote (1 2))) (omap-get o deep2)"
+                    "      (omap-count o))", "(12 0 3)");
+    CHECK_EVAL(env, "(define h (hash-map)) (hash-put! h deep 1)"
+                    "(hash-get h deep2)", "1");
+    return check::done();
+}
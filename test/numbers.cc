@@ -0,0 +1,58 @@
+#include "check.h"
+
+int main() {
+    lispy::environment env(lispy::shared_std());
+
+    // literals
+    CHECK_EVAL(env, "42", "42");
+    CHECK_EVAL(env, "-17", "-17");
+    CHECK_EVAL(env, "1.5", "1.5");
+    CHECK_EVAL(env, "1.5e3", "1500.0");
+    CHECK_EVAL(env, "2E-1", "0.2");
+    CHECK_EVAL(env, "-9223372036854775808", "-9223372036854775808");
+    CHECK_EVAL(env, "9223372036854775808", "9223372036854775808");
+
+    // an exponent marker needs digits, these are symbols and unbound
+    CHECK_ERROR(env, "1.5e");
+    CHECK_ERROR(env, "1.5e+");
+    CHECK_ERROR(env, "1e-");
+
+    // int64 overflows into bignums and back
+    CHECK_EVAL(env, "(+ 9223372036854775807 1)", "9223372036854775808");
+    CHECK_EVAL(env, "(- -9223372036854775808 1)", "-9223372036854775809");
+    CHECK_EVAL(env, "(- (+ 9223372036854775807 1) 1)", "9223372036854775807");
+    CHECK_EVAL(env, "(- 0 -9223372036854775808)", "9223372036854775808");
+    CHECK_EVAL(env, "(* -1 -9223372036854775808)", "9223372036854775808");
+    CHECK_EVAL(env, "(* 4294967296 4294967296)", "18446744073709551616");
+    CHECK_EVAL(env, "(* 18446744073709551616 18446744073709551616)",
+               "340282366920938463463374607431768211456");
+
+    // division is exact when it divides evenly, a float otherwise
+    CHECK_EVAL(env, "(/ 10 2)", "5");
+    CHECK_EVAL(env, "(/ 7 2)", "3.5");
+    CHECK_EVAL(env, "(/ -9223372036854775808 -1)", "9223372036854775808");
+    CHECK_EVAL(env, "(/ -9223372036854775808 2)", "-4611686018427387904");
+    CHECK_EVAL(env, "(/ 18446744073709551616 4294967296)", "4294967296");
+    CHECK_EVAL(env, "(/ 340282366920938463463374607431768211456"
+                    "   18446744073709551616)", "18446744073709551616");
+    CHECK_EVAL(env, "(/ 340282366920938463463374607431768211455"
+                    "   18446744073709551617)", "18446744073709551615");
+    CHECK_EVAL(env, "(/ -340282366920938463463374607431768211456"
+                    "   -18446744073709551616)", "18446744073709551616");
+    CHECK_EVAL(env, "(/ 18446744073709551616 -8589934592)", "-2147483648");
+    CHECK_EVAL(env, "(/ 18446744073709551617 18446744073709551616)",
+               "1.0");
+    CHECK_EVAL(env, "(/ 1 2.0)", "0.5");
+    CHECK_ERROR(env, "(/ 1 0)");
+    CHECK_ERROR(env, "(/ 18446744073709551616 0)");
+
+    // comparisons across int, bignum and float
+    CHECK_EVAL(env, "(< 9223372036854775807 9223372036854775808)", "#t");
+    CHECK_EVAL(env, "(= 18446744073709551616 18446744073709551616)", "#t");
+    CHECK_EVAL(env, "(< 1 1.5)", "#t");
+    CHECK_EVAL(env, "(+ 1 0.5)", "1.5");
+
+    CHECK_ERROR(env, "(+ 1 (quote a))");
+
+    return check::done();
+}
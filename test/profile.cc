@@ -0,0 +1,51 @@
+#include <sstream>
+
+#include "check.h"
+
+/// collapsed stacks recorded while evaluating src, without the counts
+std::string stacks(lispy::environment &env, const std::string &src) {
+    lispy::profiler &p = lispy::profiler::instance();
+    p.start();
+    lispy::exec(env, src);
+    p.stop();
+
+    std::ostringstream out;
+    p.collapsed(out);
+    std::istringstream in(out.str());
+    std::string line, paths;
+    while (std::getline(in, line))
+        paths += line.substr(0, line.rfind(' ')) + "\n";
+    return paths;
+}
+
+int main() {
+    lispy::environment env(lispy::shared_std());
+    lispy::exec(env, "(define spin (lambda (n) (if (< n 1) 0 (spin (- n 1)))))"
+                     "(define outer (lambda () (spin 20000)))"
+                     "(define twice (lambda () (+ (spin 20000) 1)))");
+
+    // a tail call replaces its caller in the profile, called from the VM ...
+    std::string s = stacks(env, "(outer)");
+    CHECK(s.find("spin") != std::string::npos);
+    CHECK(s.find("outer;spin") == std::string::npos);
+
+    // ... or from C++, as profile-call does
+    lispy::profiler &p = lispy::profiler::instance();
+    p.start();
+    lispy::atom outer = lispy::exec(env, "outer");
+    lispy::vm::instance().invoke(outer, env, nullptr, 0);
+    p.stop();
+    std::ostringstream out;
+    p.collapsed(out);
+    CHECK(out.str().find("spin") != std::string::npos);
+    CHECK(out.str().find("outer;spin") == std::string::npos);
+
+    // other calls nest
+    s = stacks(env, "(twice)");
+    CHECK(s.find("twice;spin") != std::string::npos);
+
+    // recording starts over every time
+    CHECK(stacks(env, "1").empty());
+
+    return check::done();
+}
@@ -0,0 +1,49 @@
+#include <cstdio>
+#include <fstream>
+
+#include "check.h"
+
+std::string nested(const std::string &open, const std::string &inner,
+                   size_t depth) {
+    std::string s;
+    for (size_t i = 0; i < depth; ++i)
+        s += open;
+    return s + inner + std::string(depth, ')');
+}
+
+int main() {
+    lispy::environment env(lispy::shared_std());
+
+    CHECK_EVAL(env, "(quote (1 (2 (3)) \"a(b\" 4.5))",
+               "(1 (2 (3)) \"a(b\" 4.5)");
+    CHECK_EVAL(env, "(quote ())", "()");
+
+    // unterminated lists end with the input
+    CHECK_EVAL(env, "(quote (1 (2 3", "(1 (2 3))");
+
+    // data is read without recursion, however deep it is
+    CHECK_EVAL(env, "(length (quote " + nested("(x ", "", 200000) + "))",
+               "2");
+
+    // expressions are compiled up to a depth limit, beyond it they fail
+    // instead of overflowing the stack
+    CHECK_EVAL(env, nested("(+ 1 ", "0", 900), "900");
+    CHECK_ERROR(env, nested("(+ 1 ", "0", 200000));
+    CHECK_EVAL(env, "(+ 1 2)", "3");
+
+    // files are read form by form
+    const char *path = "test/reader.lsp.tmp";
+    {
+        std::ofstream out(path);
+        out << "; comment\n(define a 1)\n(define b\n  (+ a 1))\n"
+            << "(define data (quote " << nested("(y ", "", 100000) << "))\n"
+            << "(+ a b)\n";
+    }
+    CHECK_EVAL(env, std::string("(load \"") + path + "\")", "3");
+    CHECK_EVAL(env, "(length data)", "2");
+    std::remove(path);
+
+    CHECK_ERROR(env, "(load \"test/no-such-file.lsp\")");
+
+    return check::done();
+}
@@ -0,0 +1,39 @@
+#include "check.h"
+
+int main() {
+    lispy::environment env(lispy::shared_std());
+
+    // tail calls run in constant space, however deep
+    lispy::exec(env, "(define count (lambda (n acc)"
+                     "  (if (< n 1) acc (count (- n 1) (+ acc 1)))))");
+    CHECK_EVAL(env, "(count 1000000 0)", "1000000");
+
+    lispy::exec(env, "(define even (lambda (n)"
+                     "  (if (= n 0) #t (odd (- n 1)))))"
+                     "(define odd (lambda (n)"
+                     "  (if (= n 0) #f (even (- n 1)))))");
+    CHECK_EVAL(env, "(even 1000001)", "nil");
+    CHECK_EVAL(env, "(odd 1000001)", "#t");
+
+    // other calls do not recurse on the C++ stack either
+    lispy::exec(env, "(define depth (lambda (n)"
+                     "  (if (< n 1) 0 (+ 1 (depth (- n 1))))))");
+    CHECK_EVAL(env, "(depth 1000000)", "1000000");
+
+    // calls are reentrant, every one gets its own frame
+    lispy::exec(env, "(define fib (lambda (n)"
+                     "  (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))");
+    CHECK_EVAL(env, "(fib 20)", "6765");
+
+    // closures keep the variables of the call that made them
+    lispy::exec(env, "(define adder (lambda (n) (lambda (x) (+ x n))))"
+                     "(define add2 (adder 2))"
+                     "(define add5 (adder 5))");
+    CHECK_EVAL(env, "(list (add2 1) (add5 1))", "(3 6)");
+
+    // errors unwind the calls in progress, the next evaluation starts clean
+    CHECK_ERROR(env, "(depth (quote x))");
+    CHECK_EVAL(env, "(depth 10)", "10");
+
+    return check::done();
+}
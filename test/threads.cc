@@ -0,0 +1,39 @@
+#include "check.h"
+
+int main() {
+    lispy::environment env(lispy::shared_std());
+    lispy::exec(env, "(define xs (quote (1 2 3 4 5 6 7 8 9 10 11 12 13 14 15"
+                     "  16 17 18 19 20 21 22 23 24 25 26 27 28 29 30 31 32)))"
+                     "(define sq (lambda (x) (* x x)))");
+
+    CHECK_EVAL(env, "(pmap sq (quote (1 2 3)))", "(1 4 9)");
+    CHECK_EVAL(env, "(pmap sq (quote ()))", "()");
+    CHECK_EVAL(env, "(preduce + 0 xs)", "528");
+    CHECK_EVAL(env, "(preduce + 5 (quote ()))", "5");
+    CHECK_EVAL(env, "(touch (future (lambda () (+ 1 2))))", "3");
+    CHECK_EVAL(env, "(touch (future + 1 2 3))", "6");
+    CHECK_EVAL(env, "(touch 7)", "7");
+
+    // futures inside futures do not starve the pool
+    CHECK_EVAL(env, "(touch (future (lambda ()"
+                    "  (preduce + 0 (pmap sq xs)))))", "11440");
+
+    // errors in tasks are raised by touch, pmap and preduce
+    CHECK_ERROR(env, "(touch (future (lambda () (car 1))))");
+    CHECK_ERROR(env, "(pmap (lambda (x) (if (= x 17) (car x) x)) xs)");
+    CHECK_ERROR(env, "(preduce (lambda (a b) (car a)) 0 xs)");
+    CHECK_EVAL(env, "(length (pmap sq xs))", "32");
+
+    // tasks consing onto the same list each get a cell of their own
+    lispy::exec(env, "(define base (cons 0 (quote ())))");
+    CHECK_EVAL(env, "(pmap (lambda (i) (car (cons i base))) xs)",
+               lispy::exec(env, "xs").repr());
+
+    // the combining function may recurse deeply while tasks wait
+    lispy::exec(env, "(define deep (lambda (n)"
+                     "  (if (< n 1) 0 (+ 1 (deep (- n 1))))))");
+    CHECK_EVAL(env, "(preduce (lambda (a b) (+ a (- b (- (deep 3000) 3000))))"
+                    "  0 xs)", "528");
+
+    return check::done();
+}